@@ -0,0 +1,25 @@
+#include "bench.h"
+#include "drivers/vga/vga.h"
+
+static uint32_t random_state = 0x12345678;
+
+// Small LCG, good enough to scatter allocations
+uint32_t bench_random()
+{
+    random_state = random_state * 1103515245 + 12345;
+    return random_state >> 8;
+}
+
+void bench_run_boot()
+{
+    vga_printf("Running boot benchmarks\n");
+    bench_pmm();
+    bench_zero_pool();
+    bench_map_range();
+    bench_spawn_exit();
+    bench_heap();
+    bench_tlb();
+    bench_context_switch();
+    bench_swap();
+    bench_sched();
+}
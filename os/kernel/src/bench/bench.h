@@ -0,0 +1,18 @@
+#pragma once
+#include <stdint.h>
+
+// Boot-time microbenchmarks. They only run when the kernel is built with
+// `make BENCH=1` (which defines KERNEL_BENCHMARKS) and print their results to the screen.
+void bench_run_boot();
+
+uint32_t bench_random();
+
+void bench_pmm();
+void bench_zero_pool();
+void bench_map_range();
+void bench_spawn_exit();
+void bench_heap();
+void bench_tlb();
+void bench_context_switch();
+void bench_swap();
+void bench_sched();
@@ -0,0 +1,62 @@
+#include "bench.h"
+#include "cpu/tsc/tsc.h"
+#include "drivers/vga/vga.h"
+#include "memory/paging/paging.h"
+#include "memory/vmalloc/vmalloc.h"
+
+// Kernel pages a switch touches between cr3 loads, like the scheduler, the
+// process list and the kernel stack do
+#define SWITCH_BENCH_PAGES 32
+#define SWITCH_BENCH_ROUNDS 2000
+
+// Ping-pong between two address spaces, touching the same kernel pages on each side
+static uint32_t bench_ping_pong(uintptr_t first_pd, uintptr_t second_pd, const volatile uint8_t* kernel_pages)
+{
+    uintptr_t prev_pd = get_current_pd();
+    uint32_t sum = 0;
+
+    uint64_t start = tsc_read();
+    for (uint32_t round = 0; round < SWITCH_BENCH_ROUNDS; round++)
+    {
+        load_pd(round % 2 ? second_pd : first_pd);
+        for (uint32_t i = 0; i < SWITCH_BENCH_PAGES; i++)
+        {
+            sum += kernel_pages[i * PAGE_SIZE];
+        }
+    }
+    uint64_t cycles = tsc_read() - start;
+
+    load_pd(prev_pd);
+    (void)sum;
+    return tsc_average_cycles(cycles, SWITCH_BENCH_ROUNDS);
+}
+
+void bench_context_switch()
+{
+    uintptr_t first_pd = paging_create_address_space();
+    uintptr_t second_pd = paging_create_address_space();
+    uint8_t* kernel_pages = vmalloc(SWITCH_BENCH_PAGES * PAGE_SIZE);
+    if (first_pd == 0 || second_pd == 0 || kernel_pages == NULL)
+    {
+        vga_printf("  context switch: no memory\n");
+    }
+    else if (!paging_global_pages_enabled())
+    {
+        vga_printf("  context switch: %d cycles (no global pages)\n",
+            bench_ping_pong(first_pd, second_pd, kernel_pages));
+    }
+    else
+    {
+        paging_set_global_pages(false);
+        uint32_t flushed_cycles = bench_ping_pong(first_pd, second_pd, kernel_pages);
+        paging_set_global_pages(true);
+        uint32_t global_cycles = bench_ping_pong(first_pd, second_pd, kernel_pages);
+
+        vga_printf("  context switch: %d cycles without global pages, %d cycles with them\n",
+            flushed_cycles, global_cycles);
+    }
+
+    vfree(kernel_pages);
+    paging_free_address_space(first_pd);
+    paging_free_address_space(second_pd);
+}
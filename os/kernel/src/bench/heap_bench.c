@@ -0,0 +1,76 @@
+#include "bench.h"
+#include "cpu/tsc/tsc.h"
+#include "drivers/vga/vga.h"
+#include "memory/heap/heap.h"
+
+#define HEAP_BENCH_SLOTS 1024
+#define HEAP_BENCH_OPERATIONS 100000
+
+typedef struct {
+    uint64_t cycles;
+    uint32_t max_cycles;
+    uint32_t count;
+} heap_bench_timing_t;
+
+static void record(heap_bench_timing_t* timing, uint64_t cycles)
+{
+    timing->cycles += cycles;
+    timing->count++;
+    if (cycles > timing->max_cycles)
+        timing->max_cycles = cycles;
+}
+
+// Mostly small objects with a tail of cluster sized buffers
+static size_t random_size()
+{
+    uint32_t r = bench_random();
+    if (r % 8 == 0)
+        return 512 + (r >> 3) % 8192;
+    return 8 + (r >> 3) % 248;
+}
+
+// Every operation picks a random slot, freeing what it holds or filling it,
+// so the allocations live for random lengths of time
+void bench_heap()
+{
+    static void* slots[HEAP_BENCH_SLOTS];
+    heap_bench_timing_t alloc_timing = {0};
+    heap_bench_timing_t free_timing = {0};
+    uint32_t failed = 0;
+
+    for (uint32_t i = 0; i < HEAP_BENCH_OPERATIONS; i++)
+    {
+        uint32_t slot = bench_random() % HEAP_BENCH_SLOTS;
+        uint64_t start;
+        if (slots[slot])
+        {
+            start = tsc_read();
+            kfree(slots[slot]);
+            record(&free_timing, tsc_read() - start);
+            slots[slot] = NULL;
+        }
+        else
+        {
+            size_t size = random_size();
+            start = tsc_read();
+            slots[slot] = kmalloc(size);
+            record(&alloc_timing, tsc_read() - start);
+            failed += slots[slot] == NULL;
+        }
+    }
+
+    heap_stats_t stats = heap_get_stats();
+
+    for (uint32_t i = 0; i < HEAP_BENCH_SLOTS; i++)
+    {
+        kfree(slots[i]);
+        slots[i] = NULL;
+    }
+
+    vga_printf("  kmalloc: %d cycles avg, %d max (%d failed)\n",
+        tsc_average_cycles(alloc_timing.cycles, alloc_timing.count), alloc_timing.max_cycles, failed);
+    vga_printf("  kfree: %d cycles avg, %d max\n",
+        tsc_average_cycles(free_timing.cycles, free_timing.count), free_timing.max_cycles);
+    vga_printf("  heap: %d KB, %d KB free in %d blocks\n",
+        stats.heap_size / 1024, stats.free_bytes / 1024, stats.free_blocks);
+}
@@ -0,0 +1,62 @@
+#include "bench.h"
+#include "cpu/tsc/tsc.h"
+#include "drivers/vga/vga.h"
+#include "memory/paging/paging.h"
+
+// Mapping cost of a large range of user pages, like an eagerly loaded binary.
+// Only the mapping is timed, no process is created
+#define MAP_BENCH_PAGES 1024
+#define MAP_BENCH_ROUNDS 4
+#define MAP_BENCH_FIRST_PAGE (0x08048000 / PAGE_SIZE)
+
+// Before batching: one allocation and one page walk per page
+static bool map_page_by_page()
+{
+    for (uint32_t i = 0; i < MAP_BENCH_PAGES; i++)
+    {
+        uint32_t page = pmm_allocate_zeroed_page(PAGE_TYPE_USER_ANON);
+        if (page == 0 || !paging_map_page_flags(page, MAP_BENCH_FIRST_PAGE + i, PTE_USER | PTE_WRITABLE))
+            return false;
+    }
+    return true;
+}
+
+static bool map_batched()
+{
+    return paging_allocate_range(MAP_BENCH_FIRST_PAGE, MAP_BENCH_PAGES, PTE_USER | PTE_WRITABLE,
+        PAGE_TYPE_USER_ANON);
+}
+
+// Time mapping into fresh address spaces, like a new process gets
+static uint32_t time_mapping(bool (*map)())
+{
+    uintptr_t prev_pd = get_current_pd();
+    uint64_t cycles = 0;
+
+    for (int round = 0; round < MAP_BENCH_ROUNDS; round++)
+    {
+        uintptr_t pd = paging_create_address_space();
+        if (pd == 0)
+            return 0;
+        load_pd(pd);
+
+        uint64_t start = tsc_read();
+        bool mapped = map();
+        cycles += tsc_read() - start;
+
+        paging_free_range(MAP_BENCH_FIRST_PAGE, MAP_BENCH_PAGES);
+        load_pd(prev_pd);
+        paging_free_address_space(pd);
+        if (!mapped)
+            return 0;
+    }
+    return tsc_cycles_to_us(cycles) / MAP_BENCH_ROUNDS;
+}
+
+void bench_map_range()
+{
+    uint32_t page_by_page_us = time_mapping(map_page_by_page);
+    uint32_t batched_us = time_mapping(map_batched);
+    vga_printf("  map %d pages: %d us page by page, %d us batched\n", MAP_BENCH_PAGES,
+        page_by_page_us, batched_us);
+}
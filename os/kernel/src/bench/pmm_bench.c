@@ -0,0 +1,81 @@
+#include "bench.h"
+#include "cpu/tsc/tsc.h"
+#include "drivers/vga/vga.h"
+#include "memory/physical/physical_memory_manager.h"
+#include "memory/heap/heap.h"
+
+#define PAGE_SIZE 4096
+#define PMM_BENCH_BATCH 256
+#define PMM_BENCH_ROUNDS 64
+
+static const uint32_t fill_levels[] = {95, 50, 10};
+
+// Time PMM_BENCH_ROUNDS batches of allocations at the current fill level
+static void bench_pmm_level(uint32_t fill_percent, uint32_t free_pages)
+{
+    static uint32_t batch[PMM_BENCH_BATCH];
+    uint32_t batch_size = free_pages / 2 < PMM_BENCH_BATCH ? free_pages / 2 : PMM_BENCH_BATCH;
+    uint64_t cycles = 0;
+
+    if (batch_size == 0)
+        return;
+
+    for (int round = 0; round < PMM_BENCH_ROUNDS; round++)
+    {
+        uint64_t start = tsc_read();
+        for (uint32_t i = 0; i < batch_size; i++)
+        {
+            batch[i] = pmm_allocate_page(PAGE_TYPE_KERNEL);
+        }
+        cycles += tsc_read() - start;
+
+        for (uint32_t i = 0; i < batch_size; i++)
+        {
+            pmm_deallocate_page(batch[i]);
+        }
+    }
+
+    vga_printf("  pmm %d%% fill: %d allocs/s\n", fill_percent,
+        tsc_rate_per_sec(batch_size * PMM_BENCH_ROUNDS, cycles));
+}
+
+void bench_pmm()
+{
+    uint32_t usable = pmm_get_max_pages() - pmm_get_used_pages();
+    uint32_t* held = kmalloc_pages(usable * sizeof(uint32_t) / PAGE_SIZE + 1);
+    uint32_t held_count = 0;
+
+    if (held == NULL)
+    {
+        vga_printf("  pmm bench: out of memory\n");
+        return;
+    }
+
+    // The array itself took some frames, take everything that is left
+    uint32_t page;
+    while ((page = pmm_allocate_page(PAGE_TYPE_KERNEL)) != 0)
+    {
+        held[held_count++] = page;
+    }
+    usable = held_count;
+
+    // Release random frames so the free ones are scattered over the whole bitmap
+    for (uint32_t level = 0; level < sizeof(fill_levels) / sizeof(fill_levels[0]); level++)
+    {
+        uint32_t target = usable / 100 * fill_levels[level];
+        while (held_count > target)
+        {
+            uint32_t index = bench_random() % held_count;
+            pmm_deallocate_page(held[index]);
+            held[index] = held[--held_count];
+        }
+
+        bench_pmm_level(fill_levels[level], usable - held_count);
+    }
+
+    while (held_count > 0)
+    {
+        pmm_deallocate_page(held[--held_count]);
+    }
+    kfree(held);
+}
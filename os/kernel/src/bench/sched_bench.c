@@ -0,0 +1,104 @@
+#include "bench.h"
+#include "cpu/tsc/tsc.h"
+#include "drivers/vga/vga.h"
+#include "process/scheduler/scheduler.h"
+
+// A shell-like process that wakes up every SCHED_BENCH_SLEEP_TICKS for one tick of work,
+// next to CPU-bound processes that never block. Simulated on a scheduler of its own,
+// one loop iteration is one timer tick
+#define SCHED_BENCH_HOGS 8
+#define SCHED_BENCH_SLEEP_TICKS 20
+#define SCHED_BENCH_TICKS 20000
+
+typedef struct {
+    uint32_t wakeups;
+    uint32_t total_latency;     // ticks from the wakeup until it runs
+    uint32_t max_latency;
+    uint64_t decision_cycles;   // spent in sched_tick and sched_pick
+    uint32_t decisions;
+} sched_bench_result_t;
+
+static void simulate(scheduler_t* scheduler, sched_bench_result_t* result)
+{
+    static sched_entity_t hogs[SCHED_BENCH_HOGS];
+    sched_entity_t interactive;
+    *result = (sched_bench_result_t){0};
+
+    for (uint32_t i = 0; i < SCHED_BENCH_HOGS; i++)
+    {
+        sched_entity_init(&hogs[i], NULL, 0);
+        sched_wake(scheduler, &hogs[i]);
+    }
+    sched_entity_init(&interactive, NULL, 0);
+
+    sched_entity_t* running = sched_pick(scheduler);
+    uint32_t wake_tick = SCHED_BENCH_SLEEP_TICKS;
+    uint32_t woken_at = 0;
+    bool waiting = false;
+
+    for (uint32_t tick = 0; tick < SCHED_BENCH_TICKS; tick++)
+    {
+        // It blocks again after its tick of work
+        if (running == &interactive)
+        {
+            running = sched_pick(scheduler);
+            wake_tick = tick + SCHED_BENCH_SLEEP_TICKS;
+        }
+        if (tick == wake_tick)
+        {
+            sched_wake(scheduler, &interactive);
+            woken_at = tick;
+            waiting = true;
+        }
+
+        uint64_t start = tsc_read();
+        if (running == NULL)
+        {
+            running = sched_pick(scheduler);
+        }
+        else if (sched_tick(scheduler, running))
+        {
+            sched_make_ready(scheduler, running);
+            running = sched_pick(scheduler);
+        }
+        result->decision_cycles += tsc_read() - start;
+        result->decisions++;
+
+        if (waiting && running == &interactive)
+        {
+            uint32_t latency = tick - woken_at;
+            result->wakeups++;
+            result->total_latency += latency;
+            if (latency > result->max_latency)
+                result->max_latency = latency;
+            waiting = false;
+        }
+    }
+}
+
+static void print_result(const char* name, const sched_bench_result_t* result)
+{
+    // In hundredths of a tick, vga_printf has no floats
+    uint32_t average = result->wakeups ? result->total_latency * 100 / result->wakeups : 0;
+    vga_printf("  %s: %d wakeups, latency %d.%d%d ticks average, %d max, %d cycles per tick\n", name,
+        result->wakeups, average / 100, average / 10 % 10, average % 10, result->max_latency,
+        tsc_average_cycles(result->decision_cycles, result->decisions));
+}
+
+// The old scheduler (round robin with 1 tick slices) against the MLFQ
+void bench_sched()
+{
+    static scheduler_t scheduler;
+    sched_bench_result_t result;
+    const uint32_t round_robin_quanta[] = { 1 };
+
+    vga_printf("  scheduler, shell next to %d CPU-bound processes:\n", SCHED_BENCH_HOGS);
+
+    sched_init(&scheduler, round_robin_quanta, 1, 0);
+    simulate(&scheduler, &result);
+    print_result("round robin", &result);
+
+    sched_init_default(&scheduler);
+    simulate(&scheduler, &result);
+    print_result("mlfq", &result);
+}
@@ -0,0 +1,94 @@
+#include "bench.h"
+#include "cpu/tsc/tsc.h"
+#include "drivers/vga/vga.h"
+#include "memory/paging/paging.h"
+#include "memory/heap/heap.h"
+#include "memory/vma/vma.h"
+#include "process/loader/elf_loader.h"
+#include "process/manager/process_manager.h"
+
+#define SPAWN_EXIT_ITERATIONS 10000
+#define SPAWN_EXIT_TOUCHED_PAGES 16
+
+// One process lifetime: created from the image, its image pages and some stack faulted in
+// through the page fault path, then torn down
+static bool spawn_and_exit(elf_image_t* image)
+{
+    process_t* process = create_process_from_image(image, 0);
+    if (process == NULL)
+        return false;
+
+    uintptr_t prev_pd = get_current_pd();
+    load_pd(process->page_directory);
+
+    bool faulted = true;
+    for (vma_t* vma = process->vmas; vma != NULL && faulted; vma = vma->next)
+    {
+        if (vma->image == NULL)
+            continue;
+        for (uint32_t i = 0; i < vma->page_amount && faulted; i++)
+        {
+            faulted = vma_handle_process_fault(process, (vma->first_page + i) * PAGE_SIZE,
+                vma->flags & VMA_WRITE);
+        }
+    }
+    for (uint32_t i = 1; i <= SPAWN_EXIT_TOUCHED_PAGES && faulted; i++)
+    {
+        faulted = vma_handle_process_fault(process, USER_STACK_TOP - i * PAGE_SIZE, true);
+    }
+
+    load_pd(prev_pd);
+    destroy_process(process->pid);
+    return faulted;
+}
+
+// Frames in use, the zero pool's frames aren't: spawns drain it and nothing refills it during boot
+static uint32_t used_pages()
+{
+    return pmm_get_used_pages() - pmm_get_zero_pool_count();
+}
+
+static uint32_t used_heap_bytes()
+{
+    heap_stats_t stats = heap_get_stats();
+    return stats.heap_size - stats.free_bytes;
+}
+
+// PMM and heap usage have to be the same after every process is gone
+void bench_spawn_exit()
+{
+    FileData data = {0};
+    elf_image_t* image = fat_get_file_data("/proc1", &data) == 0 ? elf_image_open(&data.file_entry) : NULL;
+    if (image == NULL)
+    {
+        vga_printf("  spawn/exit: no /proc1\n");
+        return;
+    }
+
+    // The first one fills the slab caches and the image's shared pages
+    bool spawned = spawn_and_exit(image);
+    uint32_t used_before = used_pages();
+    uint32_t heap_before = used_heap_bytes();
+
+    uint32_t iterations = 0;
+    uint64_t start = tsc_read();
+    while (spawned && iterations < SPAWN_EXIT_ITERATIONS && (spawned = spawn_and_exit(image)))
+    {
+        iterations++;
+    }
+    uint64_t cycles = tsc_read() - start;
+
+    uint32_t used_after = used_pages();
+    uint32_t heap_after = used_heap_bytes();
+    elf_image_put(image);
+
+    vga_printf("  spawn/exit x%d: %d cycles each, %d -> %d pages used, %d -> %d heap bytes used\n",
+        iterations, tsc_average_cycles(cycles, iterations), used_before, used_after, heap_before, heap_after);
+    if (!spawned)
+        vga_printf("  spawn/exit FAILED: a spawn or one of its faults failed\n");
+    if (used_after != used_before || heap_after != heap_before)
+    {
+        vga_printf("  spawn/exit FAILED: %d pages and %d heap bytes leaked\n", (int)(used_after - used_before),
+            (int)(heap_after - heap_before));
+    }
+}
@@ -0,0 +1,50 @@
+#include "bench.h"
+#include "cpu/tsc/tsc.h"
+#include "drivers/vga/vga.h"
+#include "memory/swap/swap.h"
+#include "process/loader/elf_loader.h"
+#include "process/manager/process_manager.h"
+
+#define SWAP_BENCH_PAGES 64
+
+// Dirty stack pages of a process that never runs are swapped out by the clock, then the
+// process is destroyed. Every slot has to be free again after it
+void bench_swap()
+{
+    FileData data = {0};
+    elf_image_t* image = fat_get_file_data("/proc1", &data) == 0 ? elf_image_open(&data.file_entry) : NULL;
+    process_t* process = image != NULL ? create_process_from_image(image, 0) : NULL;
+    if (image != NULL)
+        elf_image_put(image);
+    if (process == NULL)
+    {
+        vga_printf("  swap: no /proc1\n");
+        return;
+    }
+
+    static uint8_t pattern[PAGE_SIZE];
+    for (uint32_t i = 0; i < PAGE_SIZE; i++)
+    {
+        pattern[i] = bench_random();
+    }
+    uintptr_t first = USER_STACK_TOP - SWAP_BENCH_PAGES * PAGE_SIZE;
+    for (uint32_t i = 0; i < SWAP_BENCH_PAGES; i++)
+    {
+        paging_copy_to_address_space(process->page_directory, first + i * PAGE_SIZE, pattern, PAGE_SIZE,
+            PTE_USER | PTE_WRITABLE);
+    }
+
+    // Nothing was accessed through the page tables, the first pass already takes the pages
+    uint64_t start = tsc_read();
+    uint32_t freed = swap_reclaim(SWAP_BENCH_PAGES);
+    uint64_t cycles = tsc_read() - start;
+    uint32_t slots = swap_get_stats().used_slots;
+
+    destroy_process(process->pid);
+
+    swap_stats_t stats = swap_get_stats();
+    vga_printf("  swap out %d pages: %d cycles each, %d slots used, %d after exit\n", freed,
+        tsc_average_cycles(cycles, freed), slots, stats.used_slots);
+    vga_printf("  swap: %d scanned, %d out, %d dropped, %d io errors\n", stats.scanned, stats.swap_outs,
+        stats.dropped, stats.io_errors);
+}
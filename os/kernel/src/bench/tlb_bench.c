@@ -0,0 +1,63 @@
+#include "bench.h"
+#include "cpu/tsc/tsc.h"
+#include "drivers/vga/vga.h"
+#include "memory/paging/paging.h"
+#include "memory/vmalloc/vmalloc.h"
+
+// 8 MB is far more than the TLB covers with small pages, and a few entries with large ones
+#define TLB_BENCH_PAGES 2048
+#define TLB_BENCH_ROUNDS 8
+
+static uint16_t order[TLB_BENCH_PAGES];
+
+// Read one byte of every page in a random order, so nearly every small page touch misses the TLB
+static uint32_t bench_touch(const volatile uint8_t* base)
+{
+    uint32_t sum = 0;
+
+    uint64_t start = tsc_read();
+    for (uint32_t round = 0; round < TLB_BENCH_ROUNDS; round++)
+    {
+        for (uint32_t i = 0; i < TLB_BENCH_PAGES; i++)
+        {
+            sum += base[order[i] * PAGE_SIZE];
+        }
+    }
+    uint64_t cycles = tsc_read() - start;
+
+    (void)sum;
+    return tsc_average_cycles(cycles, TLB_BENCH_PAGES * TLB_BENCH_ROUNDS);
+}
+
+void bench_tlb()
+{
+    for (uint32_t i = 0; i < TLB_BENCH_PAGES; i++)
+    {
+        order[i] = i;
+    }
+    for (uint32_t i = TLB_BENCH_PAGES - 1; i > 0; i--)
+    {
+        uint32_t j = bench_random() % (i + 1);
+        uint16_t temp = order[i];
+        order[i] = order[j];
+        order[j] = temp;
+    }
+
+    uint8_t* small = vmalloc(TLB_BENCH_PAGES * PAGE_SIZE);
+    if (small == NULL)
+    {
+        vga_printf("  tlb: no memory\n");
+        return;
+    }
+    bench_touch(small); // warm up the caches the same way for both
+    uint32_t small_cycles = bench_touch(small);
+    vfree(small);
+
+    // The boot mapping of the first 8 MB, large pages when the cpu has them (read only)
+    const volatile uint8_t* large = (const volatile uint8_t*)0xC0000000;
+    bench_touch(large);
+    uint32_t large_cycles = bench_touch(large);
+
+    vga_printf("  page touch: %d cycles with 4 KB pages, %d cycles with the %s boot mapping\n",
+        small_cycles, large_cycles, paging_large_pages_enabled() ? "large page" : "4 KB page");
+}
@@ -0,0 +1,39 @@
+#include "bench.h"
+#include "cpu/tsc/tsc.h"
+#include "drivers/vga/vga.h"
+#include "memory/physical/physical_memory_manager.h"
+
+// Time ZERO_POOL_SIZE zeroed allocations, then give the pages back
+static uint32_t bench_zeroed_allocs()
+{
+    static uint32_t pages[ZERO_POOL_SIZE];
+    uint32_t count = 0;
+
+    uint64_t start = tsc_read();
+    while (count < ZERO_POOL_SIZE && (pages[count] = pmm_allocate_zeroed_page(PAGE_TYPE_KERNEL)) != 0)
+    {
+        count++;
+    }
+    uint64_t cycles = tsc_read() - start;
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        pmm_deallocate_page(pages[i]);
+    }
+    return tsc_average_cycles(cycles, count);
+}
+
+void bench_zero_pool()
+{
+    // The idle loop hasn't run yet, so the pool starts empty and every page is zeroed inline
+    uint32_t inline_cycles = bench_zeroed_allocs();
+
+    while (pmm_refill_zero_pool()) {}
+    uint32_t pool_cycles = bench_zeroed_allocs();
+
+    pmm_zero_pool_stats_t stats = pmm_get_zero_pool_stats();
+    vga_printf("  zeroed page: %d cycles inline, %d cycles from the pool\n", inline_cycles, pool_cycles);
+    vga_printf("  zero pool: %d%% hits, %d cycles to zero a page\n",
+        stats.hits * 100 / (stats.hits + stats.misses),
+        tsc_average_cycles(stats.zeroing_cycles, stats.pages_zeroed));
+}
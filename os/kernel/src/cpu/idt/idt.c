@@ -45,4 +45,20 @@ inline void enable_interrupts()
 inline void disable_interrupts()
 {
     __asm__("cli");
-}
\ No newline at end of file
+}
+
+// Returns the previous eflags for restore_interrupts
+inline uint32_t save_and_disable_interrupts()
+{
+    uint32_t flags;
+    __asm__ volatile("pushf\n"
+                     "pop %0\n"
+                     "cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+inline void restore_interrupts(uint32_t flags)
+{
+    if (flags & 0x200) // IF
+        __asm__ volatile("sti" : : : "memory");
+}
@@ -21,6 +21,9 @@ struct idt_pointer
 
 void enable_interrupts();
 void disable_interrupts();
+// For code that may run with interrupts either on or off
+uint32_t save_and_disable_interrupts();
+void restore_interrupts(uint32_t flags);
 
 void idt_set_entry(uint8_t index, uint32_t handlerAddress, bool is_userspace);
 void idt_init();
@@ -11,7 +11,6 @@ uint16_t reload_time = 0;
 
 uint32_t system_time = 0;
 uint32_t system_clock_fractions = 0;
-uint32_t context_switch = 0;
 
 void pit_init()
 {
@@ -35,7 +34,6 @@ void pit_init()
 static void timer_irq(int_registers* regs)
 {
     system_time++;
-    context_switch++;
     system_clock_fractions += expected_clock_fraction;
 
     if (system_clock_fractions > TARGET_FREQ_HZ) // compensate for rounding error
@@ -46,13 +44,9 @@ static void timer_irq(int_registers* regs)
 
     irq_exit(PIT_IRQ);
 
-    if (context_switch == 1)
-    {
-        context_switch = 0;
-        //vga_printf("switch ");
-        if (is_schduling())
-            switch_process(regs);
-    }
+    // The scheduler decides when the quantum of the running process is over
+    if (is_schduling())
+        scheduler_tick(regs);
 }
 
 inline uint32_t get_system_time()
@@ -0,0 +1,84 @@
+#include "tsc.h"
+#include "cpu/pit/pit.h"
+#include "util/io/io.h"
+
+static uint32_t cycles_per_ms = 0;
+
+// 64 by 32 bit division without libgcc (two chained divl's never overflow)
+static uint64_t udiv64(uint64_t dividend, uint32_t divisor)
+{
+    uint32_t high = dividend >> 32;
+    uint32_t low = (uint32_t)dividend;
+    uint32_t quotient_high = high / divisor;
+    uint32_t remainder = high % divisor;
+    uint32_t quotient_low;
+
+    asm("divl %4"
+            : "=a"(quotient_low), "=d"(remainder)
+            : "a"(low), "d"(remainder), "rm"(divisor));
+
+    return ((uint64_t)quotient_high << 32) | quotient_low;
+}
+
+void tsc_init()
+{
+    // Gate channel 2 on, keep the speaker off
+    uint8_t gate = (io_in_byte(PIT_GATE_PORT) & ~0x02) | 0x01;
+    io_out_byte(PIT_GATE_PORT, gate);
+
+    // Channel 2, lobyte/hibyte, mode 0 (interrupt on terminal count), binary
+    io_out_byte(MODE_COMMAND_REGISTER, 0xB0);
+    uint16_t latch = FREQ_HZ / 1000 * TSC_CALIBRATION_MS;
+    io_out_byte(PIT_CHANNEL2_PORT, latch & 0xFF);
+    io_out_byte(PIT_CHANNEL2_PORT, latch >> 8);
+
+    uint64_t start = tsc_read();
+    // Bit 5 goes high once the counter reaches zero
+    while (!(io_in_byte(PIT_GATE_PORT) & 0x20)) {}
+    uint64_t end = tsc_read();
+
+    cycles_per_ms = (uint32_t)(end - start) / TSC_CALIBRATION_MS;
+    if (cycles_per_ms == 0)
+        cycles_per_ms = 1;
+}
+
+inline uint64_t tsc_read()
+{
+    uint32_t low, high;
+    asm volatile ("rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t)high << 32) | low;
+}
+
+inline uint32_t tsc_cycles_per_ms()
+{
+    return cycles_per_ms;
+}
+
+uint32_t tsc_cycles_to_us(uint64_t cycles)
+{
+    return udiv64(cycles * 1000, cycles_per_ms);
+}
+
+// How many `count` operations per second, given they took `cycles`
+uint32_t tsc_rate_per_sec(uint32_t count, uint64_t cycles)
+{
+    uint64_t numerator = (uint64_t)count * cycles_per_ms * 1000;
+
+    // Scale both down until the divisor fits in 32 bits
+    while (cycles >> 32)
+    {
+        cycles >>= 1;
+        numerator >>= 1;
+    }
+    if (cycles == 0)
+        return 0;
+
+    return udiv64(numerator, (uint32_t)cycles);
+}
+
+uint32_t tsc_average_cycles(uint64_t cycles, uint32_t count)
+{
+    if (count == 0)
+        return 0;
+    return udiv64(cycles, count);
+}
@@ -0,0 +1,16 @@
+#pragma once
+#include <stdint.h>
+
+#define PIT_CHANNEL2_PORT 0x42
+#define PIT_GATE_PORT 0x61
+
+#define TSC_CALIBRATION_MS 10
+
+// Calibrates the time stamp counter against PIT channel 2 (works with interrupts disabled)
+void tsc_init();
+
+uint64_t tsc_read();
+uint32_t tsc_cycles_per_ms();
+uint32_t tsc_cycles_to_us(uint64_t cycles);
+uint32_t tsc_rate_per_sec(uint32_t count, uint64_t cycles);
+uint32_t tsc_average_cycles(uint64_t cycles, uint32_t count);
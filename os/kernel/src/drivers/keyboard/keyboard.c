@@ -188,7 +188,7 @@ static void keyboard_handler(uint8_t scan_code)
             if (key_map[scan_code] == '\n')
             {
                 active_terminal->is_input_ready = true;
-                wake_up_terminal_processes(get_active_terminal_id());
+                wake_up_all(&active_terminal->readers);
             }
 
             break;
@@ -2,6 +2,7 @@
 #include "drivers/harddisk/ata/ata.h"
 #include "drivers/vga/vga.h"
 #include "memory/heap/heap.h"
+#include "memory/scratch/scratch.h"
 
 #define IS_END_OF_CLUSTER_CHAIN(cluster) (cluster >= 0xFFF8 && cluster <= 0xFFFF)
 
@@ -11,6 +12,9 @@ FAT16_FS fat16_fs;
 uint16_t* fat_table; // will be heap allocated later
 FAT16_DirEntry root_dir = {0};
 
+static fat_change_callback_t change_callback = NULL;
+static uint16_t pinned_clusters[FAT_MAX_PINNED_FILES]; // start clusters, 0 for an empty slot
+
 // Static cluster operations
 static int fat_read_data_cluster(uint32_t cluster_num, void *buffer);
 static int fat_write_data_cluster(uint32_t cluster_num, const void *buffer);
@@ -34,6 +38,8 @@ static uint32_t fat_find_dir_entry_from_path(const char *path, FAT16_DirEntry *e
 static bool check_file_name(const char *file_name);
 static void get_parent_dir(const char *path, char *parent_dir);
 static void get_base_name(const char *path, char *name);
+static void file_changed(const FAT16_DirEntry *file);
+static bool is_pinned(const FAT16_DirEntry *file);
 
 bool fat_init()
 {
@@ -117,7 +123,7 @@ static int fat_find_free()
 
 static void fat_update_chain(int starting_fat, int new_fat_index)
 {
-    uint8_t* buffer = (uint8_t*)kmalloc(fat16_fs.bytes_per_sector * fat16_fs.sectors_per_cluster);
+    uint8_t* buffer = scratch_alloc(fat16_fs.bytes_per_sector * fat16_fs.sectors_per_cluster);
     memset(buffer, 0, fat16_fs.bytes_per_sector * fat16_fs.sectors_per_cluster);
     int before_last = starting_fat;
 
@@ -155,7 +161,7 @@ static void fat_update_chain(int starting_fat, int new_fat_index)
     }
 
     fat_write_data_cluster(new_fat_index, buffer);
-    kfree(buffer);
+    scratch_free(buffer);
 }
 
 static void fat_free_chain(int fat_index)
@@ -210,7 +216,7 @@ static int get_ith_cluster(uint32_t starting_cluster, uint32_t i)
 static bool fat_find_dir_entry(const char *name, const FAT16_DirEntry *current_dir, FAT16_DirEntry *entry)
 {
     int i = 0, cluster_num = current_dir->start_cluster;
-    FAT16_DirEntry* dir = (FAT16_DirEntry*)kmalloc(fat16_fs.bytes_per_sector * fat16_fs.sectors_per_cluster);
+    FAT16_DirEntry* dir = scratch_alloc(fat16_fs.bytes_per_sector * fat16_fs.sectors_per_cluster);
     if (fat_table == NULL)
         return false;
     memset(dir, 0, fat16_fs.bytes_per_sector * fat16_fs.sectors_per_cluster);
@@ -219,7 +225,7 @@ static bool fat_find_dir_entry(const char *name, const FAT16_DirEntry *current_d
     {   
         if (fat_read_data_cluster(cluster_num, dir))
         {
-            kfree(dir);
+            scratch_free(dir);
             return false;
         }
 
@@ -228,21 +234,21 @@ static bool fat_find_dir_entry(const char *name, const FAT16_DirEntry *current_d
             if (!strncmp(dir[dir_entry].name, name, FAT16_FILENAME_SIZE))
             {
                 memcpy(entry, &dir[dir_entry], sizeof(FAT16_DirEntry));
-                kfree(dir);
+                scratch_free(dir);
                 return true;
             } 
         }
 
         i++;
     }
-    kfree(dir);
+    scratch_free(dir);
     return false;
 }
 
 static bool fat_add_dir_entry(FAT16_DirEntry *parent_dir, const FAT16_DirEntry *new_entry)
 {
     int i = 0, cluster_num = parent_dir->start_cluster;
-    FAT16_DirEntry* dir = (FAT16_DirEntry*)kmalloc(fat16_fs.bytes_per_sector * fat16_fs.sectors_per_cluster);
+    FAT16_DirEntry* dir = scratch_alloc(fat16_fs.bytes_per_sector * fat16_fs.sectors_per_cluster);
     if (fat_table == NULL)
         return false;
     memset(dir, 0, fat16_fs.bytes_per_sector * fat16_fs.sectors_per_cluster);
@@ -251,7 +257,7 @@ static bool fat_add_dir_entry(FAT16_DirEntry *parent_dir, const FAT16_DirEntry *
     {   
         if (fat_read_data_cluster(cluster_num, dir))
         {
-            kfree(dir);
+            scratch_free(dir);
             return false;
         }
 
@@ -263,11 +269,11 @@ static bool fat_add_dir_entry(FAT16_DirEntry *parent_dir, const FAT16_DirEntry *
 
                 if(fat_write_data_cluster(cluster_num, dir))
                 {
-                    kfree(dir);
+                    scratch_free(dir);
                     return false;
                 }
                 
-                kfree(dir);
+                scratch_free(dir);
                 return true;
             } 
         }
@@ -280,7 +286,7 @@ static bool fat_add_dir_entry(FAT16_DirEntry *parent_dir, const FAT16_DirEntry *
 
     if (new_fat_index == -1)
     {
-        kfree(dir);
+        scratch_free(dir);
         return false;
     }
 
@@ -288,7 +294,7 @@ static bool fat_add_dir_entry(FAT16_DirEntry *parent_dir, const FAT16_DirEntry *
 
     if(fat_read_data_cluster(new_fat_index, dir))
     {
-        kfree(dir);
+        scratch_free(dir);
         return false;
     }
 
@@ -296,19 +302,19 @@ static bool fat_add_dir_entry(FAT16_DirEntry *parent_dir, const FAT16_DirEntry *
 
     if(fat_write_data_cluster(new_fat_index, dir))
     {
-        kfree(dir);
+        scratch_free(dir);
         return false;
     }
 
 
-    kfree(dir);
+    scratch_free(dir);
     return true;
 }
 
 static bool fat_update_dir_entry(const char *name, const FAT16_DirEntry *current_dir, const FAT16_DirEntry *new_entry)
 {
     int i = 0, cluster_num = current_dir->start_cluster;
-    FAT16_DirEntry* dir= (FAT16_DirEntry*)kmalloc(fat16_fs.bytes_per_sector * fat16_fs.sectors_per_cluster);
+    FAT16_DirEntry* dir= scratch_alloc(fat16_fs.bytes_per_sector * fat16_fs.sectors_per_cluster);
     if (fat_table == NULL)
         return false;
     memset(dir, 0, fat16_fs.bytes_per_sector * fat16_fs.sectors_per_cluster);
@@ -317,7 +323,7 @@ static bool fat_update_dir_entry(const char *name, const FAT16_DirEntry *current
     {   
         if (fat_read_data_cluster(cluster_num, dir))
         {
-            kfree(dir);
+            scratch_free(dir);
             return false;
         }
 
@@ -328,10 +334,10 @@ static bool fat_update_dir_entry(const char *name, const FAT16_DirEntry *current
                 memcpy(&dir[dir_entry], new_entry, sizeof(FAT16_DirEntry));
                 if(fat_write_data_cluster(cluster_num, dir))
                 {
-                    kfree(dir);
+                    scratch_free(dir);
                     return false;
                 }
-                kfree(dir);
+                scratch_free(dir);
                 return true;
             } 
         }
@@ -339,14 +345,14 @@ static bool fat_update_dir_entry(const char *name, const FAT16_DirEntry *current
         i++;
     }
 
-    kfree(dir);
+    scratch_free(dir);
     return false;
 }
 
 static bool fat_remove_dir_entry(const char *name, const FAT16_DirEntry *current_dir, bool delete_chain)
 {
     int i = 0, cluster_num = current_dir->start_cluster;
-    FAT16_DirEntry* dir= (FAT16_DirEntry*)kmalloc(fat16_fs.bytes_per_sector * fat16_fs.sectors_per_cluster);
+    FAT16_DirEntry* dir= scratch_alloc(fat16_fs.bytes_per_sector * fat16_fs.sectors_per_cluster);
     if (fat_table == NULL)
         return false;
     memset(dir, 0, fat16_fs.bytes_per_sector * fat16_fs.sectors_per_cluster);
@@ -355,7 +361,7 @@ static bool fat_remove_dir_entry(const char *name, const FAT16_DirEntry *current
     {   
         if (fat_read_data_cluster(cluster_num, dir))
         {
-            kfree(dir);
+            scratch_free(dir);
             return false;
         }
 
@@ -368,7 +374,7 @@ static bool fat_remove_dir_entry(const char *name, const FAT16_DirEntry *current
 
                 memset(&dir[dir_entry], 0x00, sizeof(FAT16_DirEntry));
                 fat_write_data_cluster(cluster_num, dir);
-                kfree(dir);
+                scratch_free(dir);
                 return true;
             } 
         }
@@ -376,7 +382,7 @@ static bool fat_remove_dir_entry(const char *name, const FAT16_DirEntry *current
         i++;
     }
 
-    kfree(dir);
+    scratch_free(dir);
     return false;
 }
 
@@ -627,6 +633,8 @@ static uint32_t fat_delete(const char *path, bool is_directory)
     err = fat_find_dir_entry_from_path(path, &dir);
     if (err)
         return err;
+    if (is_pinned(&dir))
+        return FILE_IS_BUSY;
 
     if (is_directory)
     {
@@ -649,6 +657,7 @@ static uint32_t fat_delete(const char *path, bool is_directory)
     if (err)
         return err;
 
+    file_changed(&dir);
     fat_remove_dir_entry(dir_name, &parent_dir, true);
 
     parent_dir.file_size--;
@@ -677,6 +686,8 @@ uint32_t fat_rename(const char *path, const char *new_name)
 
     if (err)
         return err;
+    if (is_pinned(&file))
+        return FILE_IS_BUSY;
 
     get_parent_dir(path, directory);
 
@@ -807,7 +818,7 @@ int32_t fat_read(FAT16_DirEntry* file, uint32_t offset, uint32_t size, void* buf
 
     uint32_t bytes_read = 0;
     uint8_t* buf_ptr = (uint8_t*)buffer;
-    uint8_t* cluster_buffer = (uint8_t*)kmalloc(fat16_fs.bytes_per_sector * fat16_fs.sectors_per_cluster);
+    uint8_t* cluster_buffer = scratch_alloc(fat16_fs.bytes_per_sector * fat16_fs.sectors_per_cluster);
     if (cluster_buffer == NULL)
         return GENERAL_ERROR;
     memset(cluster_buffer, 0, fat16_fs.bytes_per_sector * fat16_fs.sectors_per_cluster);
@@ -815,7 +826,7 @@ int32_t fat_read(FAT16_DirEntry* file, uint32_t offset, uint32_t size, void* buf
     while (bytes_read < size && current_cluster < FAT16_CLUSTER_CHAIN_END && current_cluster != 0) {
         // Read entire cluster
         if (fat_read_data_cluster(current_cluster, cluster_buffer)) {
-            kfree(cluster_buffer);
+            scratch_free(cluster_buffer);
             return -1;
         }
 
@@ -839,7 +850,7 @@ int32_t fat_read(FAT16_DirEntry* file, uint32_t offset, uint32_t size, void* buf
         }
     }
 
-    kfree(cluster_buffer);
+    scratch_free(cluster_buffer);
 
     return bytes_read;
 }
@@ -853,6 +864,7 @@ int32_t fat_write(FAT16_DirEntry* file, FAT16_DirEntry* parent_dir, uint32_t off
     {
         return -1;
     }
+    file_changed(file);
 
     uint32_t bytes_per_cluster = fat16_fs.bytes_per_sector * fat16_fs.sectors_per_cluster;
     uint32_t start_cluster_index = offset / bytes_per_cluster;
@@ -885,7 +897,7 @@ int32_t fat_write(FAT16_DirEntry* file, FAT16_DirEntry* parent_dir, uint32_t off
 
     uint32_t bytes_written = 0;
     const uint8_t* buf_ptr = (const uint8_t*)buffer;
-    uint8_t* cluster_buffer = (uint8_t*)kmalloc(fat16_fs.bytes_per_sector * fat16_fs.sectors_per_cluster);
+    uint8_t* cluster_buffer = scratch_alloc(fat16_fs.bytes_per_sector * fat16_fs.sectors_per_cluster);
     if (cluster_buffer == NULL)
         return GENERAL_ERROR;
     memset(cluster_buffer, 0, fat16_fs.bytes_per_sector * fat16_fs.sectors_per_cluster);
@@ -897,7 +909,7 @@ int32_t fat_write(FAT16_DirEntry* file, FAT16_DirEntry* parent_dir, uint32_t off
         {
             if (fat_read_data_cluster(current_cluster, cluster_buffer)) 
             {
-                kfree(cluster_buffer);
+                scratch_free(cluster_buffer);
                 return -1;
             }
         }
@@ -917,7 +929,7 @@ int32_t fat_write(FAT16_DirEntry* file, FAT16_DirEntry* parent_dir, uint32_t off
         // Write cluster back to disk
         if (fat_write_data_cluster(current_cluster, cluster_buffer)) 
         {
-            kfree(cluster_buffer);
+            scratch_free(cluster_buffer);
             return -1;
         }
 
@@ -931,7 +943,7 @@ int32_t fat_write(FAT16_DirEntry* file, FAT16_DirEntry* parent_dir, uint32_t off
         }
     }
 
-    kfree(cluster_buffer);
+    scratch_free(cluster_buffer);
 
     return bytes_written;
 }
@@ -943,6 +955,10 @@ int fat_truncate(FileData* file, uint32_t size)
     {
         return -1;
     }
+    if (size != file->file_entry.file_size && is_pinned(&file->file_entry))
+        return FILE_IS_BUSY;
+    if (size != file->file_entry.file_size)
+        file_changed(&file->file_entry);
 
     // if new size is smaller then the current size, free the extra clusters
     if (size < file->file_entry.file_size) 
@@ -1000,7 +1016,7 @@ int fat_get_dir_entry(FAT16_DirEntry *dir, int n, FAT16_DirEntry *entry)
     if (n >= dir->file_size)
         return FILE_NOT_FOUND;
 
-    FAT16_DirEntry* dir_buff = (FAT16_DirEntry*)kmalloc(fat16_fs.bytes_per_sector * fat16_fs.sectors_per_cluster);
+    FAT16_DirEntry* dir_buff = scratch_alloc(fat16_fs.bytes_per_sector * fat16_fs.sectors_per_cluster);
     if (fat_table == NULL)
         return false;
     memset(dir_buff, 0, fat16_fs.bytes_per_sector * fat16_fs.sectors_per_cluster);
@@ -1009,7 +1025,7 @@ int fat_get_dir_entry(FAT16_DirEntry *dir, int n, FAT16_DirEntry *entry)
     {   
         if (fat_read_data_cluster(cluster_num, dir_buff))
         {
-            kfree(dir_buff);
+            scratch_free(dir_buff);
             return CANT_ALLOCATE_SPACE;
         }
 
@@ -1018,7 +1034,7 @@ int fat_get_dir_entry(FAT16_DirEntry *dir, int n, FAT16_DirEntry *entry)
             if (count == n)
             {
                 memcpy(entry, &dir_buff[dir_entry], sizeof(FAT16_DirEntry));
-                kfree(dir_buff);
+                scratch_free(dir_buff);
                 return 0;
             }
             if (strncmp(dir_buff[dir_entry].name, "", FAT16_FILENAME_SIZE))
@@ -1029,4 +1045,42 @@ int fat_get_dir_entry(FAT16_DirEntry *dir, int n, FAT16_DirEntry *entry)
     }
 
     return FILE_NOT_FOUND;
-}   
\ No newline at end of file
+}   
+
+void fat_set_change_callback(fat_change_callback_t callback)
+{
+    change_callback = callback;
+}
+
+static void file_changed(const FAT16_DirEntry *file)
+{
+    if (change_callback != NULL && file->start_cluster != 0)
+        change_callback(file);
+}
+
+bool fat_pin_file(const FAT16_DirEntry* file)
+{
+    if (file->start_cluster == 0)
+        return false;
+    for (uint32_t i = 0; i < FAT_MAX_PINNED_FILES; i++)
+    {
+        if (pinned_clusters[i] == 0 || pinned_clusters[i] == file->start_cluster)
+        {
+            pinned_clusters[i] = file->start_cluster;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool is_pinned(const FAT16_DirEntry *file)
+{
+    if (file->start_cluster == 0)
+        return false;
+    for (uint32_t i = 0; i < FAT_MAX_PINNED_FILES; i++)
+    {
+        if (pinned_clusters[i] == file->start_cluster)
+            return true;
+    }
+    return false;
+}
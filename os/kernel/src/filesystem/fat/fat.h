@@ -75,6 +75,7 @@ typedef enum ReturnCode {
     DIRECTORY_ISNT_EMPTY = -EINVAL,
     CANT_ALLOCATE_SPACE = -ENOSPC,
     IS_DIR = -EISDIR,
+    FILE_IS_BUSY = -EBUSY,
 } ReturnCode;
 
 
@@ -93,4 +94,14 @@ uint32_t fat_delete_dir(const char *path);
 int32_t fat_read(FAT16_DirEntry* file, uint32_t offset, uint32_t size, void* buffer);
 int32_t fat_write(FAT16_DirEntry* file, FAT16_DirEntry* parent_dir, uint32_t offset, uint32_t size, const void* buffer);
 int fat_truncate(FileData* file, uint32_t size);
-int fat_get_dir_entry(FAT16_DirEntry *dir, int n, FAT16_DirEntry *entry);
\ No newline at end of file
+int fat_get_dir_entry(FAT16_DirEntry *dir, int n, FAT16_DirEntry *entry);
+
+// Called with a file's entry before its contents are written or truncated, or it's deleted.
+// The start cluster identifies the file, a deleted file's one can be reused by a new file
+typedef void (*fat_change_callback_t)(const FAT16_DirEntry* file);
+void fat_set_change_callback(fat_change_callback_t callback);
+
+// A pinned file can't be deleted, renamed or truncated (FILE_IS_BUSY), for kernel users
+// that keep its entry and cluster chain around, like the swap file
+#define FAT_MAX_PINNED_FILES 4
+bool fat_pin_file(const FAT16_DirEntry* file);
\ No newline at end of file
@@ -46,18 +46,57 @@ _start:
 ; all of the page tables from 0xc0000000 to 0xfffff000 are mapped for the kernel and also identity mapped
 %define PAGE_TABLE_COUNT    6
 
+; PAE mode: PAGE_DIRECTORY_BASE holds the PDPT, the 4 page directories follow the kernel's page tables
+%define PAE_PAGE_DIRECTORIES_BASE 0x01400000
+%define PAE_PAGE_TABLE_COUNT      12 ; entries of 2 MB each
+%define PAE_ENTRIES_PER_TABLE     512
+%define KERNEL_VIRTUAL_BASE       0xC0000000
+
 init_paging:
 	call clear_page_directory
 	call clear_page_tables
+
+	call detect_pae
+	test eax, eax
+	jnz .pae
+
+	call detect_pse
+	test eax, eax
+	jnz .pse
+
 	call create_identity_tables
 	call create_pd
+	jmp .enable_paging
+
+.pse:
+	; 4 MB pages for the identity map and the kernel, no page tables needed
+	call create_large_pd
+
+	mov eax, cr4
+	or eax, 0x10 ; CR4.PSE
+	mov cr4, eax
+	jmp .enable_paging
+
+.pae:
+	; 2 MB pages don't need CR4.PSE in PAE mode
+	call create_pae_pds
+	mov dword [boot_large_pages_enabled - KERNEL_VIRTUAL_BASE], 1
 
-	; put the page dir inside the cr3 register
+	mov eax, cr4
+	or eax, 0x20 ; CR4.PAE
+	mov cr4, eax
+
+	call enable_nx
+
+.enable_paging:
+	call enable_pge
+
+	; put the page dir (or the PDPT) inside the cr3 register
 	mov eax, PAGE_DIRECTORY_BASE
 	mov cr3, eax
 
 	mov eax, cr0
-	or eax, 0x80000000
+	or eax, 0x80010000 ; CR0.PG, and CR0.WP so the kernel's writes to copy-on-write pages fault too
 	mov cr0, eax
 
 	ret
@@ -89,6 +128,102 @@ create_pd:
 
 	ret
 
+; 4 MB pages for the identity map and the higher half, the recursive entry stays a table
+create_large_pd:
+	%assign pd_index 0
+	%rep PAGE_TABLE_COUNT
+	mov dword [PAGE_DIRECTORY_BASE + pd_index * 4], pd_index * 0x400000 + 0x83 ; present, writable, 4 MB
+	mov dword [PAGE_DIRECTORY_BASE + 0xC00 + pd_index * 4], pd_index * 0x400000 + 0x183 ; and global
+	%assign pd_index pd_index+1
+	%endrep
+
+	page_directory_definition PAGE_DIRECTORY_BASE, PAGE_DIRECTORY_BASE, 1023 * 4
+
+	ret
+
+; eax = 1 if the cpu has 4 MB pages
+detect_pse:
+	mov eax, 1
+	cpuid
+	xor eax, eax
+	test edx, 1 << 3 ; CPUID.1:EDX.PSE
+	jz .no_pse
+	mov eax, 1
+	mov [boot_large_pages_enabled - KERNEL_VIRTUAL_BASE], eax
+	.no_pse:
+	ret
+
+; Set CR4.PGE when the cpu has global pages, so reloading cr3 keeps the kernel's TLB entries.
+; The global bit is ignored without it
+enable_pge:
+	mov eax, 1
+	cpuid
+	test edx, 1 << 13 ; CPUID.1:EDX.PGE
+	jz .no_pge
+
+	mov eax, cr4
+	or eax, 0x80 ; CR4.PGE
+	mov cr4, eax
+	mov dword [boot_global_pages_enabled - KERNEL_VIRTUAL_BASE], 1
+	.no_pge:
+	ret
+
+; eax = 1 if the cpu supports PAE. Paging is still off, so the flag is written to its physical address
+detect_pae:
+	mov eax, 1
+	cpuid
+	xor eax, eax
+	test edx, 1 << 6 ; CPUID.1:EDX.PAE
+	jz .no_pae
+	mov eax, 1
+	mov [boot_pae_enabled - KERNEL_VIRTUAL_BASE], eax
+	.no_pae:
+	ret
+
+; Set EFER.NXE when the cpu has the no-execute bit
+enable_nx:
+	mov eax, 0x80000000
+	cpuid
+	cmp eax, 0x80000001
+	jb .no_nx
+	mov eax, 0x80000001
+	cpuid
+	test edx, 1 << 20 ; CPUID.80000001:EDX.NX
+	jz .no_nx
+
+	mov ecx, 0xC0000080 ; EFER
+	rdmsr
+	or eax, 1 << 11
+	wrmsr
+	mov dword [boot_nx_enabled - KERNEL_VIRTUAL_BASE], 1
+	.no_nx:
+	ret
+
+create_pae_pds:
+	; PDPT entries only have the present bit
+	%assign pd_index 0
+	%rep 4
+	mov dword [PAGE_DIRECTORY_BASE + pd_index * 8], PAE_PAGE_DIRECTORIES_BASE + pd_index * 0x1000 + 1
+	%assign pd_index pd_index+1
+	%endrep
+
+	; identity map and the same map in the higher half (the last page directory), with 2 MB pages
+	%assign pd_index 0
+	%rep PAE_PAGE_TABLE_COUNT
+	mov dword [PAE_PAGE_DIRECTORIES_BASE + pd_index * 8], pd_index * 0x200000 + 0x83
+	mov dword [PAE_PAGE_DIRECTORIES_BASE + 0x3000 + pd_index * 8], pd_index * 0x200000 + 0x183 ; and global
+	%assign pd_index pd_index+1
+	%endrep
+
+	; recursive mapping, the last 4 entries point at the 4 page directories
+	%assign pd_index 0
+	%rep 4
+	mov dword [PAE_PAGE_DIRECTORIES_BASE + 0x3000 + (508 + pd_index) * 8], PAE_PAGE_DIRECTORIES_BASE + pd_index * 0x1000 + 3
+	%assign pd_index pd_index+1
+	%endrep
+
+	ret
+
 create_identity_tables:
 	mov eax, 0 ; index
 	mov ebx, 0 ; physical address	
@@ -157,6 +292,16 @@ HaltKernel:
 	jmp HaltKernel
 
 section .data
+; The paging mode picked by init_paging, read by memory/paging
+global boot_pae_enabled
+global boot_nx_enabled
+global boot_large_pages_enabled
+global boot_global_pages_enabled
+boot_pae_enabled: dd 0
+boot_nx_enabled: dd 0
+boot_large_pages_enabled: dd 0 ; the boot mapping uses 4 MB (2 MB in PAE mode) pages
+boot_global_pages_enabled: dd 0 ; CR4.PGE is set
+
 align 4096
 
 
@@ -6,13 +6,19 @@
 #include "memory/physical/physical_memory_manager.h"
 #include "memory/paging/paging.h"
 #include "memory/heap/heap.h"
+#include "memory/vmalloc/vmalloc.h"
+#include "memory/vma/vma.h"
+#include "memory/swap/swap.h"
 #include "drivers/harddisk/ata/ata.h"
 #include "filesystem/fat/fat.h"
 #include "drivers/keyboard/keyboard.h"
 #include "process/manager/process_manager.h"
+#include "process/loader/elf_loader.h"
 #include "process/syscalls/syscalls.h"
 #include "terminal/terminal_manager.h"
 #include "process/syscalls/handlers/time/time.h"
+#include "cpu/tsc/tsc.h"
+#include "bench/bench.h"
 
 #include <fcntl.h>
 
@@ -48,31 +54,56 @@ void kmain(multiboot_info_t *mbi)
         vga_printf("failed pmm init");
         return;
     }
+    paging_kmap_init();
+    paging_free_boot_page_tables();
+    vga_printf("Paging mode: %s%s\n", paging_pae_enabled() ? (paging_nx_enabled() ? "PAE with NX" : "PAE") : "32 bit",
+        paging_large_pages_enabled() ? ", large pages" : "");
 
     if (!heap_init())
     {
         vga_printf("failed heap init");
         return;
     }
+    if (!vmalloc_init())
+    {
+        vga_printf("failed vmalloc init");
+        return;
+    }
+
+    tsc_init();
     
     pit_init();
 
     fat_init();
+    fat_set_change_callback(elf_image_file_changed);
+    // Not fatal, reclaim can still drop clean pages without it
+    if (!swap_init())
+        vga_printf("no swap file\n");
 
     keyboard_init();
     syscall_init();
 
+    vma_init();
     proc_manager_init();
     set_active_terminal(create_terminal(1));
 
     vga_init();
     print_logo();
 
+#ifdef KERNEL_BENCHMARKS
+    bench_run_boot();
+#endif
+
     create_process("/proc1", 0);
     create_process("/proc2", 0);
 
     asm ("sti");
     enable_processes();
     
-    while (1){}
+    // Idle loop, the scheduler comes back here whenever no process is ready
+    while (1)
+    {
+        if (!pmm_refill_zero_pool())
+            asm ("hlt");
+    }
 }
\ No newline at end of file
@@ -1,221 +1,417 @@
 #include "heap.h"
 #include "../paging/paging.h"
+#include "../vmalloc/vmalloc.h"
+#include "heap_profiler.h"
 #include "../../drivers/vga/vga.h"
 
-#define BLOCK_SIZE(block) ((uintptr_t)block->next - (uintptr_t)block - sizeof(heap_entry))
 #define ALIGN(size, alignment) (((size) + (alignment)-1) & ~((alignment)-1))
-#define MIN_BLOCK_SIZE 4
+#define HEAP_HEADER_SIZE sizeof(size_t)
+// A free block has to hold its list links and its footer
+#define MIN_BLOCK_SIZE (2 * sizeof(heap_block*) + sizeof(size_t))
+
+#define BLOCK_SIZE(block) ((block)->size & ~HEAP_BLOCK_FLAGS)
+#define BLOCK_PAYLOAD(block) ((void*)((uintptr_t)(block) + HEAP_HEADER_SIZE))
+#define PAYLOAD_BLOCK(payload) ((heap_block*)((uintptr_t)(payload) - HEAP_HEADER_SIZE))
+#define BLOCK_NEXT(block) ((heap_block*)((uintptr_t)BLOCK_PAYLOAD(block) + BLOCK_SIZE(block)))
+#define BLOCK_FOOTER(block) ((size_t*)BLOCK_NEXT(block) - 1)
 
 static const uintptr_t heap_start = KERNEL_CODE_END;
 static uintptr_t curr_heap_end = KERNEL_CODE_END;
-static heap_entry* last_entry;
 
-static void *heap_find_first_free_space(size_t wanted_size);
-static void free_block(heap_entry *block);
-static bool allocate_heap_page();
-static void deallocate_last_heap_page();
+// The size class lists, with a bitmap of the non empty ones on each level
+static heap_block* free_lists[HEAP_FL_COUNT][HEAP_SL_COUNT];
+static uint32_t fl_bitmap;
+static uint32_t sl_bitmap[HEAP_FL_COUNT];
+static heap_stats_t heap_stats;
+static heap_policy_t heap_policy = {
+    .grow_chunk = HEAP_DEFAULT_GROW_CHUNK,
+    .trim_slack = HEAP_DEFAULT_TRIM_SLACK,
+    .trim_threshold = HEAP_DEFAULT_TRIM_THRESHOLD,
+};
 
-bool heap_init()
+static heap_block* heap_find_free_block(size_t wanted_size);
+static heap_block* heap_grow(size_t page_amount);
+static void heap_trim(heap_block* last_block);
+static heap_block* merge_block(heap_block* block);
+static void free_block(heap_block* block);
+static bool allocate_heap_pages(size_t page_amount);
+static void deallocate_last_heap_pages(size_t page_amount);
+
+static inline uint32_t find_last_set(uint32_t word)
+{
+    return 31 - __builtin_clz(word);
+}
+
+static inline uint32_t find_first_set(uint32_t word)
+{
+    return __builtin_ctz(word);
+}
+
+// The list a block of this size is kept in
+static void mapping_insert(size_t size, uint32_t* fl, uint32_t* sl)
 {
-    if (!allocate_heap_page())
+    if (size < HEAP_SMALL_BLOCK_SIZE)
     {
-        return false;
+        *fl = 0;
+        *sl = size / (HEAP_SMALL_BLOCK_SIZE / HEAP_SL_COUNT);
+    }
+    else
+    {
+        uint32_t last_bit = find_last_set(size);
+        *sl = (size >> (last_bit - HEAP_SL_COUNT_LOG2)) ^ HEAP_SL_COUNT;
+        *fl = last_bit - (HEAP_FL_SHIFT - 1);
+    }
+}
+
+// The first list where every block is big enough for this size
+static void mapping_search(size_t size, uint32_t* fl, uint32_t* sl)
+{
+    if (size >= HEAP_SMALL_BLOCK_SIZE)
+    {
+        size += (1 << (find_last_set(size) - HEAP_SL_COUNT_LOG2)) - 1;
+    }
+    else
+    {
+        size = ALIGN(size, HEAP_SMALL_BLOCK_SIZE / HEAP_SL_COUNT);
     }
+    mapping_insert(size, fl, sl);
+}
 
-    // Set up the first block
-    heap_entry* first = (heap_entry *)heap_start;
-    last_entry = (heap_entry*)(curr_heap_end - sizeof(heap_entry));
-    last_entry->next = NULL;
-    last_entry->prev = first;
-    last_entry->is_free = false;
+static void insert_free_block(heap_block* block)
+{
+    uint32_t fl, sl;
+    mapping_insert(BLOCK_SIZE(block), &fl, &sl);
 
-    first->next = last_entry;
-    first->prev = NULL;
-    first->is_free = true;
-    return true;
+    block->size |= HEAP_BLOCK_FREE;
+    *BLOCK_FOOTER(block) = BLOCK_SIZE(block);
+    BLOCK_NEXT(block)->size |= HEAP_BLOCK_PREV_FREE;
+
+    block->prev_free = NULL;
+    block->next_free = free_lists[fl][sl];
+    if (block->next_free)
+    {
+        block->next_free->prev_free = block;
+    }
+    free_lists[fl][sl] = block;
+    fl_bitmap |= 1U << fl;
+    sl_bitmap[fl] |= 1U << sl;
+
+    heap_stats.free_bytes += BLOCK_SIZE(block);
+    heap_stats.free_blocks++;
 }
 
-static void *heap_find_first_free_space(size_t wanted_size)
+static void remove_free_block(heap_block* block)
 {
-    if (wanted_size == 0 || wanted_size > KERNEL_HEAP_END - heap_start)
+    uint32_t fl, sl;
+    mapping_insert(BLOCK_SIZE(block), &fl, &sl);
+
+    if (block->prev_free)
     {
-        return NULL;
+        block->prev_free->next_free = block->next_free;
     }
-    heap_entry *curr = (heap_entry *)heap_start;
-    wanted_size = ALIGN(wanted_size, 4);
-    int i = 0;
-    // Find the first block with enough space
-    while (!curr->is_free || curr->next == NULL || BLOCK_SIZE(curr) < wanted_size)
+    else
     {
-        if (curr->next == NULL || (uintptr_t)curr->next >= curr_heap_end) // This entry marks the end of the heap
+        free_lists[fl][sl] = block->next_free;
+        if (free_lists[fl][sl] == NULL)
         {
-            // Not enough space, allocate another page
-            if (!allocate_heap_page())
-            {
-                return NULL;
-            }
-            
-            if (curr->prev && curr->prev->is_free)
-            {
-                // Update the size of the last entry
-                curr = curr->prev;
-            }
-            else
+            sl_bitmap[fl] &= ~(1U << sl);
+            if (sl_bitmap[fl] == 0)
             {
-                // Use this entry (the last one) as an entry for the new page's block
-                curr->is_free = true;
+                fl_bitmap &= ~(1U << fl);
             }
-            
-            // Define the new last_entry
-            curr->next = (heap_entry*)(curr_heap_end - sizeof(heap_entry));
+        }
+    }
+    if (block->next_free)
+    {
+        block->next_free->prev_free = block->prev_free;
+    }
 
-            last_entry = curr->next;
-            last_entry->next = NULL;
-            last_entry->prev = curr;
-            last_entry->is_free = false;
+    block->size &= ~HEAP_BLOCK_FREE;
+    BLOCK_NEXT(block)->size &= ~HEAP_BLOCK_PREV_FREE;
 
-            continue; // Try the new entry again, dont go to the next one           
-        }
+    heap_stats.free_bytes -= BLOCK_SIZE(block);
+    heap_stats.free_blocks--;
+}
+
+// Cut the block down to `size`, the rest becomes a free block
+static void split_block(heap_block* block, size_t size)
+{
+    size_t block_size = BLOCK_SIZE(block);
+    if (block_size < size + HEAP_HEADER_SIZE + MIN_BLOCK_SIZE)
+    {
+        return;
+    }
+
+    block->size = size | (block->size & HEAP_BLOCK_FLAGS);
+    heap_block* rest = BLOCK_NEXT(block);
+    rest->size = block_size - size - HEAP_HEADER_SIZE;
+    free_block(rest);
+}
 
-        // Check the next block
-        curr = curr->next;
-        i++;
+// Merge a block that is being freed with its free neighbours, the result is in no list
+static heap_block* merge_block(heap_block* block)
+{
+    heap_block* next = BLOCK_NEXT(block);
+    if (next->size & HEAP_BLOCK_FREE)
+    {
+        remove_free_block(next);
+        block->size += BLOCK_SIZE(next) + HEAP_HEADER_SIZE;
     }
 
-    // Need to split the block to two different blocks
-    if (BLOCK_SIZE(curr) >= wanted_size + sizeof(heap_entry) + MIN_BLOCK_SIZE)
+    if (block->size & HEAP_BLOCK_PREV_FREE)
     {
-        heap_entry *curr_end = curr->next;
-        curr->next = (heap_entry*)((uintptr_t)curr + wanted_size + sizeof(heap_entry));
-    
-        curr->next->next = curr_end;
-        curr->next->prev = curr;
-        curr->next->is_free = true;
+        // The footer of the previous block is right before this header
+        size_t prev_size = *((size_t*)block - 1);
+        heap_block* prev = (heap_block*)((uintptr_t)block - prev_size - HEAP_HEADER_SIZE);
+        remove_free_block(prev);
+        prev->size += BLOCK_SIZE(block) + HEAP_HEADER_SIZE;
+        block = prev;
+    }
+    return block;
+}
 
-        curr_end->prev = curr->next;
+static void free_block(heap_block* block)
+{
+    block = merge_block(block);
+    insert_free_block(block);
+
+    // Give the top of the heap back
+    if (BLOCK_SIZE(BLOCK_NEXT(block)) == 0)
+    {
+        heap_trim(block);
     }
+}
 
-    // Keep the current size of the block
-    curr->is_free = false;
+bool heap_init()
+{
+    if (!allocate_heap_pages(1))
+    {
+        return false;
+    }
 
-    return (void *)((uintptr_t)curr + sizeof(heap_entry));
+    // The last word of the heap is a used, empty block, so no block runs past the end
+    heap_block* first = (heap_block*)heap_start;
+    first->size = PAGE_SIZE - 2 * HEAP_HEADER_SIZE;
+    BLOCK_NEXT(first)->size = 0;
+    insert_free_block(first);
+    return true;
 }
 
-static void free_block(heap_entry *block)
+static heap_block* heap_find_free_block(size_t wanted_size)
 {
-    if ((uintptr_t)block < heap_start || (uintptr_t)block > KERNEL_HEAP_END || block->next == NULL)
+    uint32_t fl, sl;
+    mapping_search(wanted_size, &fl, &sl);
+    if (fl >= HEAP_FL_COUNT)
     {
-        return;
+        return NULL;
     }
 
-    // Last block
-    if (block->next->next == NULL)
+    uint32_t sl_map = sl_bitmap[fl] & (~0U << sl);
+    if (sl_map == 0)
     {
-        last_entry = block;
-        last_entry->next = NULL;
-        last_entry->is_free = true;
-        // Is the block on the last page too?
-        if (ALIGN((uintptr_t)block, PAGE_SIZE) < ALIGN(curr_heap_end, PAGE_SIZE))
+        // No block in this power of two, take the smallest bigger one
+        uint32_t fl_map = fl + 1 < HEAP_FL_COUNT ? fl_bitmap & (~0U << (fl + 1)) : 0;
+        if (fl_map == 0)
         {
-            deallocate_last_heap_page();
+            return NULL;
         }
-        return;
+        fl = find_first_set(fl_map);
+        sl_map = sl_bitmap[fl];
     }
-    
-    // Combine the previous block with it
-    if (block->prev && block->prev->is_free)
+    sl = find_first_set(sl_map);
+
+    heap_block* block = free_lists[fl][sl];
+    remove_free_block(block);
+    return block;
+}
+
+// Map more pages at the top of the heap and return them as one free block,
+// merged with the block before them when it is free
+static heap_block* heap_grow(size_t page_amount)
+{
+    // The end marker becomes the header of the new block
+    heap_block* block = (heap_block*)(curr_heap_end - HEAP_HEADER_SIZE);
+
+    // Grow by a whole chunk when there is memory for it
+    if (page_amount >= heap_policy.grow_chunk || !allocate_heap_pages(heap_policy.grow_chunk))
     {
-        block->prev->next = block->next;
-        return;
+        if (!allocate_heap_pages(page_amount))
+        {
+            return NULL;
+        }
+    }
+    else
+    {
+        page_amount = heap_policy.grow_chunk;
     }
+    heap_stats.grows++;
+    heap_stats.grown_pages += page_amount;
+
+    block->size = (page_amount * PAGE_SIZE - HEAP_HEADER_SIZE) | (block->size & HEAP_BLOCK_PREV_FREE);
+    BLOCK_NEXT(block)->size = 0;
+    return merge_block(block);
+}
 
-    // Combine the next block with it
-    if (block->next->is_free)
+// Release the whole free pages at the end of the heap once there are more than
+// the trim threshold, down to the slack
+static void heap_trim(heap_block* last_block)
+{
+    uintptr_t min_end = ALIGN((uintptr_t)BLOCK_PAYLOAD(last_block) + MIN_BLOCK_SIZE + HEAP_HEADER_SIZE, PAGE_SIZE);
+    uint32_t free_pages = min_end < curr_heap_end ? (curr_heap_end - min_end) / PAGE_SIZE : 0;
+    if (free_pages <= heap_policy.trim_threshold)
     {
-        block->next = block->next->next;
+        return;
     }
-    block->is_free = true;
+    uint32_t trimmed_pages = free_pages - heap_policy.trim_slack;
+    uintptr_t keep_end = curr_heap_end - trimmed_pages * PAGE_SIZE;
+
+    remove_free_block(last_block);
+    deallocate_last_heap_pages(trimmed_pages);
+    heap_stats.trims++;
+    heap_stats.trimmed_pages += trimmed_pages;
+
+    last_block->size = (keep_end - (uintptr_t)BLOCK_PAYLOAD(last_block) - HEAP_HEADER_SIZE) |
+        (last_block->size & HEAP_BLOCK_PREV_FREE);
+    BLOCK_NEXT(last_block)->size = 0;
+    insert_free_block(last_block);
 }
 
-static bool allocate_heap_page()
+// Map the next heap pages with single pages, allocated and mapped in batches
+static bool allocate_heap_pages(size_t page_amount)
 {
-    if (curr_heap_end >= KERNEL_HEAP_END)
+    if (curr_heap_end + page_amount * PAGE_SIZE > KERNEL_HEAP_END)
     {
         return false;
     }
-    if (allocate_kernel_virtual_page(curr_heap_end / PAGE_SIZE, true))
+
+    uint32_t pages[MAP_BATCH_SIZE];
+    size_t allocated = 0;
+    while (allocated < page_amount)
     {
-        curr_heap_end += PAGE_SIZE;
-        return true;
+        uint32_t batch = page_amount - allocated < MAP_BATCH_SIZE ? page_amount - allocated : MAP_BATCH_SIZE;
+        if (!pmm_allocate_pages(batch, pages, PAGE_TYPE_HEAP))
+        {
+            deallocate_last_heap_pages(allocated);
+            return false;
+        }
+
+        // The kernel's page tables are preallocated, mapping can't fail
+        paging_map_range(curr_heap_end / PAGE_SIZE, pages, batch, PTE_WRITABLE);
+        curr_heap_end += batch * PAGE_SIZE;
+        allocated += batch;
     }
-    return false;
+    return true;
 }
 
-static void deallocate_last_heap_page()
+// Unmap the pages first and flush the TLB once for all of them
+static void deallocate_last_heap_pages(size_t page_amount)
 {
-    const uintptr_t last_page_start_addr = curr_heap_end - PAGE_SIZE;
-    deallocate_virtual_page(last_page_start_addr / PAGE_SIZE);
-    curr_heap_end -= PAGE_SIZE;
-}
+    uint32_t first_page = curr_heap_end / PAGE_SIZE - page_amount;
+    paging_flush_batch_t batch;
+    paging_flush_batch_init(&batch);
 
-inline void* kmalloc(size_t size)
-{
-    return heap_find_first_free_space(size);
+    for (size_t i = 0; i < page_amount; i++)
+    {
+        deallocate_virtual_page(first_page + i);
+    }
+    curr_heap_end -= page_amount * PAGE_SIZE;
+
+    paging_flush_batch_add(&batch, first_page, page_amount);
+    paging_flush_batch_commit(&batch);
 }
 
-void* kmalloc_pages(size_t page_amount)
+static void* heap_allocate(size_t size)
 {
-    if (page_amount == 0 || page_amount > (KERNEL_HEAP_END - heap_start) / PAGE_SIZE)
+    if (size == 0)
     {
         return NULL;
     }
-    // this is the page we will return
-    for (int i = 0; i < page_amount + 1; i++)
+    if (size >= HEAP_LARGE_ALLOCATION)
     {
-        if (!allocate_heap_page())
+        return vmalloc(size);
+    }
+    size = ALIGN(size < MIN_BLOCK_SIZE ? MIN_BLOCK_SIZE : size, 4);
+
+    heap_block* block = heap_find_free_block(size);
+    if (block == NULL)
+    {
+        size_t page_amount = ALIGN(size + 2 * HEAP_HEADER_SIZE, PAGE_SIZE) / PAGE_SIZE;
+        block = heap_grow(page_amount);
+        if (block == NULL)
         {
-            for (int j = 0; j < i; j++)
-            {
-                deallocate_last_heap_page();
-            }
             return NULL;
         }
     }
-    heap_entry* returned_entry =
-            (heap_entry*)(curr_heap_end - ((page_amount + 1) * PAGE_SIZE) - sizeof(heap_entry));
-    returned_entry->is_free = false;
 
-    if (!last_entry->prev->is_free)
+    split_block(block, size);
+    return BLOCK_PAYLOAD(block);
+}
+
+static void heap_free(void* buffer)
+{
+    if (is_vmalloc_address(buffer))
     {
-        last_entry->prev->next = returned_entry;
-        returned_entry->prev = last_entry->prev;
+        vfree(buffer);
+        return;
     }
-    else
+    if ((uintptr_t)buffer < heap_start + HEAP_HEADER_SIZE || (uintptr_t)buffer >= curr_heap_end)
     {
-        // discard the last block
-        last_entry->prev->prev->next = returned_entry;
-        returned_entry->prev = last_entry->prev->prev;
+        return;
     }
 
-    // the new last free block on the heap
-    returned_entry->next = (heap_entry*)((uintptr_t)returned_entry + page_amount * PAGE_SIZE + sizeof(heap_entry));
-    returned_entry->next->is_free = true;
+    heap_block* block = PAYLOAD_BLOCK(buffer);
+    if (block->size & HEAP_BLOCK_FREE)
+    {
+        return; // double free
+    }
+    free_block(block);
+}
 
-    last_entry = (heap_entry*)(curr_heap_end - sizeof(heap_entry));
-    last_entry->is_free = false;
-    last_entry->prev = returned_entry->next;
-    returned_entry->next->next = last_entry;
-    returned_entry->next->prev = returned_entry;
-    return (void*)((uintptr_t)returned_entry + sizeof(heap_entry));
+void* kmalloc(size_t size)
+{
+    void* buffer = heap_allocate(size);
+    HEAP_PROFILE_ALLOC(buffer, size);
+    return buffer;
 }
 
-inline void kfree(void *addr)
+// Page sized allocations come from vmalloc, so they can be given back without
+// waiting for everything above them in the heap
+void* kmalloc_pages(size_t page_amount)
 {
-    // free the block using the heap entry's address
-    free_block((heap_entry *)((uintptr_t)addr - sizeof(heap_entry)));
+    if (page_amount == 0 || page_amount > (VMALLOC_END - VMALLOC_START) / PAGE_SIZE)
+    {
+        return NULL;
+    }
+    void* buffer = vmalloc(page_amount * PAGE_SIZE);
+    HEAP_PROFILE_ALLOC(buffer, page_amount * PAGE_SIZE);
+    return buffer;
+}
+
+void kfree(void* buffer)
+{
+    HEAP_PROFILE_FREE(buffer);
+    heap_free(buffer);
 }
 
 inline int get_heap_end()
 {
     return curr_heap_end;
 }
+
+bool heap_set_policy(heap_policy_t policy)
+{
+    // A chunk bigger than the gap between the two would be trimmed right after growing
+    if (policy.grow_chunk == 0 || policy.trim_threshold <= policy.trim_slack ||
+        policy.grow_chunk > policy.trim_threshold - policy.trim_slack)
+    {
+        return false;
+    }
+    heap_policy = policy;
+    return true;
+}
+
+heap_stats_t heap_get_stats()
+{
+    heap_stats.heap_size = curr_heap_end - heap_start;
+    return heap_stats;
+}
@@ -7,14 +7,58 @@
 // extern char _kernel_end;
 
 #define KERNEL_CODE_END 0xC1800000
-#define KERNEL_HEAP_END 0xFFFFF000
+#define KERNEL_HEAP_END 0xE0000000 // the vmalloc region starts here
 
-typedef struct heap_entry
+// kmalloc hands allocations this big to vmalloc
+#define HEAP_LARGE_ALLOCATION (4 * 0x1000)
+
+// Free blocks are kept in segregated lists (TLSF): the first level splits the sizes
+// by powers of two, the second level splits every power of two into HEAP_SL_COUNT classes
+#define HEAP_SL_COUNT_LOG2 4
+#define HEAP_SL_COUNT (1 << HEAP_SL_COUNT_LOG2)
+#define HEAP_FL_SHIFT (HEAP_SL_COUNT_LOG2 + 3)
+#define HEAP_FL_MAX 30 // blocks are smaller than 1 GB
+#define HEAP_FL_COUNT (HEAP_FL_MAX - HEAP_FL_SHIFT + 1)
+#define HEAP_SMALL_BLOCK_SIZE (1 << HEAP_FL_SHIFT) // sizes below this get one first level
+
+#define HEAP_BLOCK_FREE      0x1
+#define HEAP_BLOCK_PREV_FREE 0x2
+#define HEAP_BLOCK_FLAGS     0x3
+
+// Every block starts with its size, free blocks also hold their free list links
+// and repeat the size in their last word (the footer), so a freed block can find
+// the block before it
+typedef struct heap_block
+{
+    size_t size; // of the payload, HEAP_BLOCK_* flags in the low bits
+    struct heap_block* next_free;
+    struct heap_block* prev_free;
+} heap_block;
+
+// The heap grows by at least grow_chunk pages. It only shrinks once more than
+// trim_threshold pages at its top are free, and then keeps trim_slack of them,
+// so allocations bouncing around the top don't map and unmap pages every time
+typedef struct
+{
+    uint32_t grow_chunk;
+    uint32_t trim_slack;
+    uint32_t trim_threshold;
+} heap_policy_t;
+
+#define HEAP_DEFAULT_GROW_CHUNK 16
+#define HEAP_DEFAULT_TRIM_SLACK 32
+#define HEAP_DEFAULT_TRIM_THRESHOLD 64
+
+typedef struct
 {
-    bool is_free;
-    struct heap_entry* next;
-    struct heap_entry* prev;
-} heap_entry;
+    uint32_t heap_size;
+    uint32_t free_bytes;
+    uint32_t free_blocks;
+    uint32_t grows;
+    uint32_t grown_pages;
+    uint32_t trims;
+    uint32_t trimmed_pages;
+} heap_stats_t;
 
 bool heap_init();
 
@@ -23,4 +67,7 @@ void* kmalloc_pages(size_t page_amount);
 
 void kfree(void* buffer);
 
-int get_heap_end();
\ No newline at end of file
+int get_heap_end();
+heap_stats_t heap_get_stats();
+// trim_threshold has to be above trim_slack, by at least grow_chunk
+bool heap_set_policy(heap_policy_t policy);
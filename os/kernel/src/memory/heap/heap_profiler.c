@@ -0,0 +1,139 @@
+#include "heap_profiler.h"
+#include "drivers/vga/vga.h"
+#include <string.h>
+
+#ifdef KERNEL_HEAP_PROFILER
+
+// A live allocation, so kfree knows its size and its site
+typedef struct {
+    uintptr_t buffer;   // 0 when the slot is empty
+    uint32_t size;
+    uint16_t site;
+} heap_profile_allocation_t;
+
+static heap_profile_site_t sites[HEAP_PROFILER_SITES];
+static uint32_t site_count = 0;
+static heap_profile_allocation_t allocations[HEAP_PROFILER_ALLOCATIONS];
+static uint32_t untracked = 0; // allocations that didn't fit in one of the tables
+
+// Multiplicative hash, the middle bits are the well mixed ones
+static inline uint32_t hash(uintptr_t value)
+{
+    return ((value >> 2) * 2654435761U) >> 16;
+}
+
+// Open addressing, sites are never removed
+static heap_profile_site_t* find_site(uintptr_t caller)
+{
+    uint32_t index = hash(caller) & (HEAP_PROFILER_SITES - 1);
+    for (uint32_t i = 0; i < HEAP_PROFILER_SITES; i++, index = (index + 1) & (HEAP_PROFILER_SITES - 1))
+    {
+        if (sites[index].caller == caller)
+            return &sites[index];
+        if (sites[index].caller == 0)
+        {
+            sites[index].caller = caller;
+            site_count++;
+            return &sites[index];
+        }
+    }
+    return NULL;
+}
+
+void heap_profiler_alloc(void* buffer, size_t size, uintptr_t caller)
+{
+    if (buffer == NULL)
+        return;
+
+    heap_profile_site_t* site = find_site(caller);
+    if (site == NULL)
+    {
+        untracked++;
+        return;
+    }
+    site->allocations++;
+
+    uint32_t index = hash((uintptr_t)buffer) & (HEAP_PROFILER_ALLOCATIONS - 1);
+    for (uint32_t i = 0; i < HEAP_PROFILER_ALLOCATIONS; i++, index = (index + 1) & (HEAP_PROFILER_ALLOCATIONS - 1))
+    {
+        if (allocations[index].buffer == 0)
+        {
+            allocations[index].buffer = (uintptr_t)buffer;
+            allocations[index].size = size;
+            allocations[index].site = site - sites;
+
+            site->live_bytes += size;
+            if (site->live_bytes > site->peak_bytes)
+                site->peak_bytes = site->live_bytes;
+            return;
+        }
+    }
+    untracked++;
+}
+
+void heap_profiler_free(void* buffer)
+{
+    if (buffer == NULL)
+        return;
+
+    uint32_t mask = HEAP_PROFILER_ALLOCATIONS - 1;
+    uint32_t index = hash((uintptr_t)buffer) & mask;
+    for (uint32_t i = 0; i < HEAP_PROFILER_ALLOCATIONS; i++, index = (index + 1) & mask)
+    {
+        if (allocations[index].buffer == 0)
+            return; // allocated before the table had room for it
+        if (allocations[index].buffer == (uintptr_t)buffer)
+            break;
+    }
+    if (allocations[index].buffer != (uintptr_t)buffer)
+        return;
+
+    heap_profile_site_t* site = &sites[allocations[index].site];
+    site->live_bytes -= allocations[index].size;
+    site->frees++;
+
+    // Shift the following entries of the probe run back, so lookups never
+    // stop early at the hole
+    uint32_t hole = index;
+    for (uint32_t next = (hole + 1) & mask; allocations[next].buffer != 0; next = (next + 1) & mask)
+    {
+        uint32_t home = hash(allocations[next].buffer) & mask;
+        if (((next - home) & mask) >= ((next - hole) & mask))
+        {
+            allocations[hole] = allocations[next];
+            hole = next;
+        }
+    }
+    allocations[hole].buffer = 0;
+}
+
+void heap_profiler_dump()
+{
+    vga_printf("heap profile: %d sites, %d untracked allocations\n", site_count, untracked);
+    for (uint32_t i = 0; i < HEAP_PROFILER_SITES; i++)
+    {
+        if (sites[i].caller == 0)
+            continue;
+        vga_printf("  0x%x: %d live, %d peak, %d allocs, %d frees\n", sites[i].caller,
+            sites[i].live_bytes, sites[i].peak_bytes, sites[i].allocations, sites[i].frees);
+    }
+}
+
+int _heap_profile(heap_profile_site_t* buffer, unsigned int count)
+{
+    if (buffer == NULL)
+    {
+        heap_profiler_dump();
+        return site_count;
+    }
+
+    unsigned int copied = 0;
+    for (uint32_t i = 0; i < HEAP_PROFILER_SITES && copied < count; i++)
+    {
+        if (sites[i].caller != 0)
+            memcpy(&buffer[copied++], &sites[i], sizeof(heap_profile_site_t));
+    }
+    return site_count;
+}
+
+#endif
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Allocation profiler for kmalloc, kmalloc_pages and kfree, keyed by the caller's
+// return address. Built with `make HEAP_PROFILE=1` (which defines KERNEL_HEAP_PROFILER),
+// otherwise the hooks compile to nothing
+#define HEAP_PROFILER_SITES 256         // power of 2
+#define HEAP_PROFILER_ALLOCATIONS 4096  // live allocations tracked at once, power of 2
+
+typedef struct {
+    uintptr_t caller;       // return address of the allocation
+    uint32_t live_bytes;
+    uint32_t peak_bytes;
+    uint32_t allocations;
+    uint32_t frees;
+} heap_profile_site_t;
+
+#ifdef KERNEL_HEAP_PROFILER
+#define HEAP_PROFILE_ALLOC(buffer, size) heap_profiler_alloc(buffer, size, (uintptr_t)__builtin_return_address(0))
+#define HEAP_PROFILE_FREE(buffer) heap_profiler_free(buffer)
+#else
+#define HEAP_PROFILE_ALLOC(buffer, size) ((void)0)
+#define HEAP_PROFILE_FREE(buffer) ((void)0)
+#endif
+
+void heap_profiler_alloc(void* buffer, size_t size, uintptr_t caller);
+void heap_profiler_free(void* buffer);
+
+// Prints every site to the screen
+void heap_profiler_dump();
+// Copies up to `count` sites to `sites` (or prints them when it's NULL), returns how many sites there are
+int _heap_profile(heap_profile_site_t* sites, unsigned int count);
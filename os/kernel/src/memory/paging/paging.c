@@ -1,146 +1,910 @@
 #include "paging.h"
+#include "memory/heap/heap.h"
+#include "memory/swap/swap.h"
 
+// Recursive mapping: the last page directory entry (the last 4 in PAE mode) points at the
+// page directories themselves, so all the page tables show up as one array of entries
 #define PAGE_DIR_ADDR    0xFFFFF000
 #define PAGE_TABLES_ADDR 0xFFC00000
+#define PAE_PAGE_DIRS_ADDR   0xFFFFC000
+#define PAE_PAGE_TABLES_ADDR 0xFF800000
 
-#define KERNEL_PAGE_DIR_PHYS_ADDR 0x00006000
+#define KERNEL_PAGE_DIR_PHYS_ADDR 0x00006000 // the PDPT in PAE mode
 #define KERNEL_PAGE_TABLES_PHYS_ADDR 0x01100000
+#define KERNEL_PAE_PAGE_TABLES_PHYS_ADDR 0x01200000
+#define KERNEL_PAE_PAGE_DIRS_PHYS_ADDR 0x01400000
 
-#define GET_PAGE_TABLE(vpn) ((page_table_entry*)(PAGE_TABLES_ADDR + ((vpn) / PAGES_PER_TABLE) * PAGE_SIZE))
+// The page tables boot.asm maps the first 24 MB with, when it uses small pages
+#define BOOT_PAGE_TABLE_COUNT 6
+#define BOOT_PAE_PAGE_TABLE_COUNT 12
 
-// The locations of the structures that work along all directories thanks to recursive mapping
-static const page_directory_entry* page_directory = (page_directory_entry*)PAGE_DIR_ADDR;
-static const page_table_entry* page_tables = (page_table_entry*)PAGE_TABLES_ADDR;
-// A variable to keep track of the virtual address (in the higher half) of the current pd
-// of the current process
-static page_directory_entry* current_page_directory = 
-(page_directory_entry*)(KERNEL_PAGE_DIR_PHYS_ADDR + RELOCATION_OFFSET);
+#define PAE_PAGE_DIRS 4
+#define CR4_PGE 0x80
+#define PAE_ENTRIES_PER_TABLE 512
+#define ENTRIES_PER_TABLE (boot_pae_enabled ? PAE_ENTRIES_PER_TABLE : 1024)
+#define KERNEL_FIRST_PDE (RELOCATION_OFFSET / PAGE_SIZE / ENTRIES_PER_TABLE)
 
-// page table addr can be NULL if the page is in the higher half (above 0xC0000000) 
-void paging_map_page(uint32_t physical_page_index, uint32_t virtual_page_index, 
-    bool only_kernel_mode, uintptr_t page_table_phys_addr)
+// Set by boot.asm
+extern uint32_t boot_pae_enabled;
+extern uint32_t boot_nx_enabled;
+extern uint32_t boot_large_pages_enabled;
+extern uint32_t boot_global_pages_enabled;
+
+static uintptr_t current_page_directory = KERNEL_PAGE_DIR_PHYS_ADDR;
+
+static inline uintptr_t pde_address(uint32_t virtual_page_index)
+{
+    if (boot_pae_enabled)
+        return PAE_PAGE_DIRS_ADDR + (virtual_page_index / PAE_ENTRIES_PER_TABLE) * sizeof(uint64_t);
+    return PAGE_DIR_ADDR + (virtual_page_index / 1024) * sizeof(uint32_t);
+}
+
+static inline uintptr_t pte_address(uint32_t virtual_page_index)
+{
+    if (boot_pae_enabled)
+        return PAE_PAGE_TABLES_ADDR + virtual_page_index * sizeof(uint64_t);
+    return PAGE_TABLES_ADDR + virtual_page_index * sizeof(uint32_t);
+}
+
+// The kernel's own page directory entry through its higher half mapping,
+// works no matter which address space is loaded
+static inline uintptr_t kernel_pde_address(uint32_t pde_index)
+{
+    if (boot_pae_enabled)
+        return KERNEL_PAE_PAGE_DIRS_PHYS_ADDR + RELOCATION_OFFSET + pde_index * sizeof(uint64_t);
+    return KERNEL_PAGE_DIR_PHYS_ADDR + RELOCATION_OFFSET + pde_index * sizeof(uint32_t);
+}
+
+// Every kernel page table is preallocated, so all address spaces can share them
+static inline uint32_t kernel_page_table(uint32_t pde_index)
+{
+    if (boot_pae_enabled)
+        return KERNEL_PAE_PAGE_TABLES_PHYS_ADDR / PAGE_SIZE + (pde_index - KERNEL_FIRST_PDE);
+    return KERNEL_PAGE_TABLES_PHYS_ADDR / PAGE_SIZE + pde_index;
+}
+
+static inline pte_t read_entry(uintptr_t address)
+{
+    if (boot_pae_enabled)
+        return *(volatile uint64_t*)address;
+    return *(volatile uint32_t*)address;
+}
+
+static inline void write_entry(uintptr_t address, pte_t entry)
+{
+    if (!boot_pae_enabled)
+    {
+        *(volatile uint32_t*)address = (uint32_t)entry;
+        return;
+    }
+
+    if (!boot_nx_enabled)
+        entry &= ~PTE_NX; // reserved bit without NX support
+
+    // Write the half with the present bit last when mapping and first when unmapping,
+    // so the cpu never sees half an entry
+    volatile uint32_t* halves = (volatile uint32_t*)address;
+    if (entry & PTE_PRESENT)
+    {
+        halves[1] = entry >> 32;
+        halves[0] = (uint32_t)entry;
+    }
+    else
+    {
+        halves[0] = (uint32_t)entry;
+        halves[1] = entry >> 32;
+    }
+}
+
+inline bool paging_pae_enabled()
+{
+    return boot_pae_enabled;
+}
+
+inline bool paging_nx_enabled()
+{
+    return boot_nx_enabled;
+}
+
+inline bool paging_large_pages_enabled()
+{
+    return boot_large_pages_enabled;
+}
+
+// A large page covers what one page table would
+inline uint32_t paging_large_page_pages()
 {
-    page_directory_entry* pd_entry = &page_directory[virtual_page_index / PAGES_PER_TABLE];
+    return ENTRIES_PER_TABLE;
+}
+
+inline bool paging_global_pages_enabled()
+{
+    return boot_global_pages_enabled;
+}
+
+// The kernel half is the same in every address space, so its entries survive cr3 reloads.
+// Page directory entries of page tables stay non global, the recursive mapping reads them as pages
+static inline pte_t global_flag(uint32_t virtual_page_index)
+{
+    return boot_global_pages_enabled && virtual_page_index >= RELOCATION_OFFSET / PAGE_SIZE ? PTE_GLOBAL : 0;
+}
+
+// Make sure the page table of the page exists
+static bool map_page_table(uint32_t virtual_page_index, bool user)
+{
+    uintptr_t pde = pde_address(virtual_page_index);
+    pte_t entry = read_entry(pde);
 
     // If the PDE is not present then initialize
-    if (!pd_entry->present)
+    if (!(entry & PTE_PRESENT))
     {
-        // get the page table's physical address
+        uint32_t pde_index = virtual_page_index / ENTRIES_PER_TABLE;
+        uint32_t page_table_index;
+
         if (virtual_page_index >= RELOCATION_OFFSET / PAGE_SIZE)
         {
-            page_table_phys_addr = KERNEL_PAGE_TABLES_PHYS_ADDR + 
-                (virtual_page_index / PAGES_PER_TABLE) * sizeof(page_table_entry) * PAGES_PER_TABLE;
+            page_table_index = kernel_page_table(pde_index);
         }
-        memset(pd_entry, 0, sizeof(page_directory_entry));
-        pd_entry->present = 1;
-        pd_entry->read_write = 1;
-        pd_entry->table_entry_address = page_table_phys_addr >> 12;
+        else
+        {
+            page_table_index = pmm_allocate_zeroed_page(PAGE_TYPE_PAGE_TABLE);
+            if (page_table_index == 0)
+                return false;
+        }
+
+        entry = PTE_MAKE(page_table_index, PTE_PRESENT | PTE_WRITABLE);
+        write_entry(pde, entry);
+
+        // Keep the kernel's page directory up to date for address spaces created later
+        if (pde_index >= KERNEL_FIRST_PDE)
+            write_entry(kernel_pde_address(pde_index), entry);
     }
-    // Bit shifting is necessary to transfer
-    page_table_entry* page_table = GET_PAGE_TABLE(virtual_page_index);
-    page_table_entry* pt_entry = &page_table[virtual_page_index % 1024];
 
-    // Initialize the page table entry
-    pt_entry->physical_page_address = physical_page_index;
-    pt_entry->user_supervisor = !only_kernel_mode;
-    pt_entry->present = 1;
-    pt_entry->read_write = 1;
+    // A large page has no page table to put the entry in
+    if (entry & PTE_LARGE)
+        return false;
 
-    // Set pd_entry values
-    pd_entry->user_supervisor |= !only_kernel_mode; // if the entry is already with user permissions then keep it
+    // if the entry is already with user permissions then keep it
+    if (user && !(entry & PTE_USER))
+        write_entry(pde, entry | PTE_USER);
 
+    return true;
 }
 
-inline void paging_map_kernel_page(uint32_t physical_page_index, uint32_t virtual_page_index, 
+bool paging_map_page_flags(uint32_t physical_page_index, uint32_t virtual_page_index, pte_t flags)
+{
+    if (!map_page_table(virtual_page_index, flags & PTE_USER))
+        return false;
+
+    write_entry(pte_address(virtual_page_index),
+        PTE_MAKE(physical_page_index, flags | PTE_PRESENT | global_flag(virtual_page_index)));
+    return true;
+}
+
+// Fill consecutive PTEs, resolving each page table once.
+// On failure the pages mapped so far stay mapped
+bool paging_map_range(uint32_t first_virtual_page_index, const uint32_t* physical_pages, uint32_t count,
+    pte_t flags)
+{
+    uint32_t entry_size = boot_pae_enabled ? sizeof(uint64_t) : sizeof(uint32_t);
+    uint32_t i = 0;
+
+    flags |= PTE_PRESENT | global_flag(first_virtual_page_index);
+
+    while (i < count)
+    {
+        uint32_t virtual_page_index = first_virtual_page_index + i;
+        if (!map_page_table(virtual_page_index, flags & PTE_USER))
+            return false;
+
+        uint32_t table_end = (virtual_page_index / ENTRIES_PER_TABLE + 1) * ENTRIES_PER_TABLE;
+        uintptr_t pte = pte_address(virtual_page_index);
+        for (; i < count && first_virtual_page_index + i < table_end; i++, pte += entry_size)
+        {
+            write_entry(pte, PTE_MAKE(physical_pages[i], flags));
+        }
+    }
+    return true;
+}
+
+// Back a range of the current address space with new zeroed pages, all or nothing
+bool paging_allocate_range(uint32_t first_virtual_page_index, uint32_t count, pte_t flags, page_type_t type)
+{
+    uint32_t pages[MAP_BATCH_SIZE];
+
+    for (uint32_t done = 0; done < count; )
+    {
+        uint32_t batch = count - done < MAP_BATCH_SIZE ? count - done : MAP_BATCH_SIZE;
+        if (!pmm_allocate_zeroed_pages(batch, pages, type))
+        {
+            paging_free_range(first_virtual_page_index, done);
+            return false;
+        }
+
+        if (!paging_map_range(first_virtual_page_index + done, pages, batch, flags))
+        {
+            // Give back the pages that didn't get mapped, the mapped ones are freed with the range
+            for (uint32_t i = 0; i < batch; i++)
+            {
+                if (!(paging_get_entry(first_virtual_page_index + done + i) & PTE_PRESENT))
+                    pmm_deallocate_page(pages[i]);
+            }
+            paging_free_range(first_virtual_page_index, done + batch);
+            return false;
+        }
+        done += batch;
+    }
+    return true;
+}
+
+void paging_free_range(uint32_t first_virtual_page_index, uint32_t count)
+{
+    paging_flush_batch_t batch;
+    paging_flush_batch_init(&batch);
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        deallocate_virtual_page(first_virtual_page_index + i);
+    }
+    paging_flush_batch_add(&batch, first_virtual_page_index, count);
+    paging_flush_batch_commit(&batch);
+}
+
+bool paging_map_page(uint32_t physical_page_index, uint32_t virtual_page_index, bool only_kernel_mode)
+{
+    return paging_map_page_flags(physical_page_index, virtual_page_index,
+        PTE_WRITABLE | (only_kernel_mode ? 0 : PTE_USER));
+}
+
+inline void paging_map_kernel_page(uint32_t physical_page_index, uint32_t virtual_page_index,
     bool supervisor_permissions)
 {
-    paging_map_page(physical_page_index, virtual_page_index, supervisor_permissions, 0);
+    paging_map_page(physical_page_index, virtual_page_index, supervisor_permissions);
 }
 
 void paging_unmap_page(uint32_t virtual_page_index)
 {
-    page_table_entry* pte = get_pte(virtual_page_index);
-    if (pte)
+    paging_set_entry(virtual_page_index, 0);
+}
+
+inline void paging_flush_tlb_page(uint32_t virtual_page_index)
+{
+    asm volatile ("invlpg (%0)" : : "r"(virtual_page_index * PAGE_SIZE) : "memory");
+}
+
+// Reloading cr3 keeps global entries, toggling CR4.PGE drops them too
+void paging_flush_tlb_all()
+{
+    if (!boot_global_pages_enabled)
+    {
+        load_pd(current_page_directory);
+        return;
+    }
+    paging_set_global_pages(false);
+    paging_set_global_pages(true);
+}
+
+void paging_set_global_pages(bool enabled)
+{
+    uint32_t cr4;
+    asm volatile ("mov %%cr4, %0" : "=r"(cr4));
+    cr4 = enabled ? cr4 | CR4_PGE : cr4 & ~CR4_PGE;
+    asm volatile ("mov %0, %%cr4" : : "r"(cr4) : "memory");
+}
+
+pte_t paging_get_entry(uint32_t virtual_page_index)
+{
+    pte_t pde = read_entry(pde_address(virtual_page_index));
+    if (!(pde & PTE_PRESENT))
+        return 0; // no page table
+
+    // The entry the page would have if the large page were split into small ones
+    if (pde & PTE_LARGE)
+    {
+        uint32_t frame = PTE_FRAME(pde) + virtual_page_index % ENTRIES_PER_TABLE;
+        return PTE_MAKE(frame, pde & ~(PTE_FRAME_MASK | PTE_LARGE));
+    }
+    return read_entry(pte_address(virtual_page_index));
+}
+
+void paging_set_entry(uint32_t virtual_page_index, pte_t entry)
+{
+    pte_t pde = read_entry(pde_address(virtual_page_index));
+    if ((pde & PTE_PRESENT) && !(pde & PTE_LARGE))
+        write_entry(pte_address(virtual_page_index), entry);
+}
+
+bool paging_map_large_page(uint32_t physical_page_index, uint32_t virtual_page_index, pte_t flags)
+{
+    uint32_t pde_index = virtual_page_index / ENTRIES_PER_TABLE;
+    uintptr_t pde = pde_address(virtual_page_index);
+
+    if (!boot_large_pages_enabled || physical_page_index % ENTRIES_PER_TABLE != 0 ||
+        virtual_page_index % ENTRIES_PER_TABLE != 0)
+        return false;
+    // Don't drop the page table of mapped small pages
+    if ((read_entry(pde) & PTE_PRESENT) && !(read_entry(pde) & PTE_LARGE))
+        return false;
+
+    pte_t entry = PTE_MAKE(physical_page_index, flags | PTE_PRESENT | PTE_LARGE | global_flag(virtual_page_index));
+    write_entry(pde, entry);
+    if (pde_index >= KERNEL_FIRST_PDE)
+        write_entry(kernel_pde_address(pde_index), entry);
+    return true;
+}
+
+void paging_unmap_large_page(uint32_t virtual_page_index)
+{
+    uint32_t pde_index = virtual_page_index / ENTRIES_PER_TABLE;
+    uintptr_t pde = pde_address(virtual_page_index);
+
+    if (!(read_entry(pde) & PTE_LARGE))
+        return;
+
+    write_entry(pde, 0);
+    if (pde_index >= KERNEL_FIRST_PDE)
+        write_entry(kernel_pde_address(pde_index), 0);
+    paging_flush_tlb_page(virtual_page_index);
+}
+
+void paging_kmap_init()
+{
+    // Map and unmap a slot once so the window's PDE is in the kernel PD
+    // before process page directories copy it
+    paging_map_kernel_page(0, KMAP_WINDOW_ADDR / PAGE_SIZE, true);
+    paging_unmap_page(KMAP_WINDOW_ADDR / PAGE_SIZE);
+    paging_flush_tlb_page(KMAP_WINDOW_ADDR / PAGE_SIZE);
+}
+
+// The boot page tables of the first 24 MB aren't used when the boot mapping has large pages
+void paging_free_boot_page_tables()
+{
+    if (!boot_large_pages_enabled)
+        return;
+
+    uint32_t tables = boot_pae_enabled ? BOOT_PAE_PAGE_TABLE_COUNT : BOOT_PAGE_TABLE_COUNT;
+    for (uint32_t i = 0; i < tables; i++)
+    {
+        pmm_deallocate_page(KERNEL_PAGE_TABLES_PHYS_ADDR / PAGE_SIZE + i);
+    }
+}
+
+void paging_link_kernel_tables(uint32_t first_virtual_page_index, uint32_t page_amount)
+{
+    uint32_t end = first_virtual_page_index + page_amount;
+    for (uint32_t i = first_virtual_page_index; i < end; i += ENTRIES_PER_TABLE - i % ENTRIES_PER_TABLE)
+    {
+        map_page_table(i, false);
+    }
+}
+
+void* paging_kmap(kmap_slot_t slot, uint32_t physical_page_index)
+{
+    uint32_t virtual_page_index = KMAP_WINDOW_ADDR / PAGE_SIZE + slot;
+    paging_map_kernel_page(physical_page_index, virtual_page_index, true);
+    paging_flush_tlb_page(virtual_page_index);
+    return (void*)(virtual_page_index * PAGE_SIZE);
+}
+
+void paging_kunmap(kmap_slot_t slot)
+{
+    uint32_t virtual_page_index = KMAP_WINDOW_ADDR / PAGE_SIZE + slot;
+    paging_unmap_page(virtual_page_index);
+    paging_flush_tlb_page(virtual_page_index);
+}
+
+void paging_flush_batch_init(paging_flush_batch_t* batch)
+{
+    batch->range_count = 0;
+    batch->total_pages = 0;
+    batch->kernel = false;
+}
+
+void paging_flush_batch_add(paging_flush_batch_t* batch, uint32_t first_virtual_page_index, uint32_t page_amount)
+{
+    if (page_amount == 0)
+        return;
+
+    batch->total_pages += page_amount;
+    if (global_flag(first_virtual_page_index + page_amount - 1))
+        batch->kernel = true;
+    // Past the threshold only the total matters, the ranges are never walked
+    if (batch->total_pages > FLUSH_BATCH_PAGES_THRESHOLD)
+        return;
+
+    // Grow the last range when the new one continues it
+    uint32_t last = batch->range_count - 1;
+    if (batch->range_count > 0 && batch->first_page[last] + batch->page_amount[last] == first_virtual_page_index)
+    {
+        batch->page_amount[last] += page_amount;
+        return;
+    }
+    if (batch->range_count == FLUSH_BATCH_RANGES)
     {
-        pte->present = 0;
+        batch->total_pages = FLUSH_BATCH_PAGES_THRESHOLD + 1; // out of room, flush everything
+        return;
     }
+    batch->first_page[batch->range_count] = first_virtual_page_index;
+    batch->page_amount[batch->range_count] = page_amount;
+    batch->range_count++;
 }
 
-uintptr_t get_physical_address(void* virtual_address)
+void paging_flush_batch_commit(paging_flush_batch_t* batch)
 {
-    uint32_t virtual_page_index = (uintptr_t)virtual_address / PAGE_SIZE;
-    page_directory_entry* pd_entry = &page_directory[virtual_page_index / PAGES_PER_TABLE];
+    if (batch->total_pages > FLUSH_BATCH_PAGES_THRESHOLD)
+    {
+        // Cheaper to drop the whole TLB than to invalidate page by page
+        if (batch->kernel)
+            paging_flush_tlb_all();
+        else
+            load_pd(current_page_directory);
+    }
+    else
+    {
+        for (uint32_t range = 0; range < batch->range_count; range++)
+        {
+            for (uint32_t i = 0; i < batch->page_amount[range]; i++)
+            {
+                paging_flush_tlb_page(batch->first_page[range] + i);
+            }
+        }
+    }
+    paging_flush_batch_init(batch);
+}
 
-    if (!pd_entry->present)
+uint64_t get_physical_address(void* virtual_address)
+{
+    pte_t entry = paging_get_entry((uintptr_t)virtual_address / PAGE_SIZE);
+    if (!(entry & PTE_PRESENT))
     {
         return 0; // not mapped
     }
 
-    page_table_entry* page_table = GET_PAGE_TABLE(virtual_page_index);
-    page_table_entry* pt_entry = &page_table[virtual_page_index % 1024];
-    return (pt_entry->physical_page_address << 12) + ((uintptr_t)virtual_address % PAGE_SIZE);
+    return (entry & PTE_FRAME_MASK) + ((uintptr_t)virtual_address % PAGE_SIZE);
 }
 
 // Wrappers for physical memory
-bool allocate_kernel_virtual_page(uint32_t virtual_page_index, bool supervisor_permissions)
+bool allocate_kernel_virtual_page(uint32_t virtual_page_index, bool supervisor_permissions, page_type_t type)
 {
-    uint32_t physical_page_index = pmm_allocate_page();
+    uint32_t physical_page_index = pmm_allocate_page(type);
     if (physical_page_index == 0)
         return false; // out of memory
 
-    // page_table_entry* current_entry = get_pte(virtual_page_index);
-    // if (current_entry && current_entry->present)
-    //     return false; // Page already allocated
-    
     paging_map_kernel_page(physical_page_index, virtual_page_index, supervisor_permissions);
     return true;
 }
 
 void deallocate_virtual_page(uint32_t virtual_page_index)
 {
-    page_table_entry* pte = get_pte(virtual_page_index);
-    if (pte)
+    pte_t entry = paging_get_entry(virtual_page_index);
+    if (entry & PTE_PRESENT)
+    {
+        pmm_page_unref(PTE_FRAME(entry));
+        paging_unmap_page(virtual_page_index);
+    }
+    else if (entry & PTE_SWAP)
+    {
+        swap_slot_put(PTE_FRAME(entry));
+        paging_set_entry(virtual_page_index, 0);
+    }
+}
+
+// The user half starts empty, the kernel half is copied from the kernel's page directory
+static uintptr_t create_pd()
+{
+    uint32_t pd_index = pmm_allocate_zeroed_page(PAGE_TYPE_PAGE_TABLE);
+    if (pd_index == 0)
+        return 0;
+
+    uint32_t* pd = paging_kmap(KMAP_SLOT_PAGING, pd_index);
+    for (uint32_t i = KERNEL_FIRST_PDE; i < 1023; i++)
+    {
+        pd[i] = *(uint32_t*)kernel_pde_address(i);
+    }
+    // Implement recursive mapping (map the last entry to the page directory itself)
+    pd[1023] = PTE_MAKE(pd_index, PTE_PRESENT | PTE_WRITABLE);
+    paging_kunmap(KMAP_SLOT_PAGING);
+
+    return pd_index * PAGE_SIZE;
+}
+
+static uintptr_t create_pae_pds()
+{
+    uint32_t pd_indexes[PAE_PAGE_DIRS] = {0};
+    // cr3 only holds 32 bits, the page directories themselves can be anywhere
+    uint32_t pdpt_index = pmm_allocate_low_page(PAGE_TYPE_PAGE_TABLE);
+
+    for (uint32_t i = 0; i < PAE_PAGE_DIRS && pdpt_index != 0; i++)
+    {
+        pd_indexes[i] = pmm_allocate_zeroed_page(PAGE_TYPE_PAGE_TABLE);
+        if (pd_indexes[i] == 0)
+        {
+            while (i--)
+                pmm_page_unref(pd_indexes[i]);
+            pmm_page_unref(pdpt_index);
+            pdpt_index = 0;
+        }
+    }
+    if (pdpt_index == 0)
+        return 0;
+
+    uint64_t* pdpt = paging_kmap(KMAP_SLOT_PAGING, pdpt_index);
+    memset(pdpt, 0, PAGE_SIZE);
+    for (uint32_t i = 0; i < PAE_PAGE_DIRS; i++)
+    {
+        pdpt[i] = PTE_MAKE(pd_indexes[i], PTE_PRESENT);
+    }
+
+    // The last page directory has the kernel and the recursive mapping
+    uint64_t* pd = paging_kmap(KMAP_SLOT_PAGING, pd_indexes[PAE_PAGE_DIRS - 1]);
+    for (uint32_t i = 0; i < PAE_ENTRIES_PER_TABLE - PAE_PAGE_DIRS; i++)
+    {
+        pd[i] = *(uint64_t*)kernel_pde_address(KERNEL_FIRST_PDE + i);
+    }
+    for (uint32_t i = 0; i < PAE_PAGE_DIRS; i++)
+    {
+        pd[PAE_ENTRIES_PER_TABLE - PAE_PAGE_DIRS + i] = PTE_MAKE(pd_indexes[i], PTE_PRESENT | PTE_WRITABLE);
+    }
+    paging_kunmap(KMAP_SLOT_PAGING);
+
+    return pdpt_index * PAGE_SIZE;
+}
+
+uintptr_t paging_create_address_space()
+{
+    return boot_pae_enabled ? create_pae_pds() : create_pd();
+}
+
+// The physical page of the page directory that holds `pde_index` in an address space, and the entry's
+// index in it. In PAE mode the PDPT has to be read first
+static uint32_t address_space_pd(uintptr_t page_directory, uint32_t pde_index, uint32_t* entry_index)
+{
+    if (!boot_pae_enabled)
     {
-        pmm_deallocate_page(pte->physical_page_address);
-        pte->present = 0;
+        *entry_index = pde_index;
+        return page_directory / PAGE_SIZE;
     }
+
+    uint64_t* pdpt = paging_kmap(KMAP_SLOT_PAGING, page_directory / PAGE_SIZE);
+    uint32_t pd_index = PTE_FRAME(pdpt[pde_index / PAE_ENTRIES_PER_TABLE]);
+    paging_kunmap(KMAP_SLOT_PAGING);
+    *entry_index = pde_index % PAE_ENTRIES_PER_TABLE;
+    return pd_index;
 }
 
-// Helper functions
-page_table_entry* get_pte(uint32_t virtual_page_index)
+// Share the frames of one user page table, the parent's writable pages turn copy-on-write too
+static void clone_page_table(uint32_t pde_index, uint32_t table_index)
 {
-    return &page_tables[virtual_page_index];
+    uint32_t entry_size = boot_pae_enabled ? sizeof(uint64_t) : sizeof(uint32_t);
+    uintptr_t parent = pte_address(pde_index * ENTRIES_PER_TABLE);
+    uintptr_t child = (uintptr_t)paging_kmap(KMAP_SLOT_PAGING, table_index);
+
+    for (uint32_t i = 0; i < ENTRIES_PER_TABLE; i++, parent += entry_size, child += entry_size)
+    {
+        pte_t entry = read_entry(parent);
+        if (entry & PTE_PRESENT)
+        {
+            if (entry & PTE_WRITABLE)
+            {
+                entry = (entry & ~PTE_WRITABLE) | PTE_COW;
+                write_entry(parent, entry);
+            }
+            pmm_page_ref(PTE_FRAME(entry));
+        }
+        else if (entry & PTE_SWAP)
+        {
+            swap_slot_dup(PTE_FRAME(entry));
+        }
+        write_entry(child, entry);
+    }
+    paging_kunmap(KMAP_SLOT_PAGING);
 }
 
-inline void load_pd(page_directory_entry *pd)
+uintptr_t paging_clone_address_space()
 {
-    uintptr_t phys_addr = get_physical_address(pd);
-    current_page_directory = pd;
-    load_pd_phys_addr(phys_addr);
+    uint32_t table_count = 0;
+    for (uint32_t i = 0; i < KERNEL_FIRST_PDE; i++)
+    {
+        if (read_entry(pde_address(i * ENTRIES_PER_TABLE)) & PTE_PRESENT)
+            table_count++;
+    }
+
+    // All the page tables are allocated first, so nothing has to be undone halfway
+    uint32_t* tables = table_count > 0 ? kmalloc(table_count * sizeof(uint32_t)) : NULL;
+    uintptr_t clone = paging_create_address_space();
+    if ((table_count > 0 && tables == NULL) || clone == 0 ||
+        (table_count > 0 && !pmm_allocate_pages(table_count, tables, PAGE_TYPE_PAGE_TABLE)))
+    {
+        kfree(tables);
+        paging_free_address_space(clone);
+        return 0;
+    }
+
+    for (uint32_t i = 0, table = 0; i < KERNEL_FIRST_PDE; i++)
+    {
+        pte_t pde = read_entry(pde_address(i * ENTRIES_PER_TABLE));
+        if (!(pde & PTE_PRESENT))
+            continue;
+
+        clone_page_table(i, tables[table]);
+
+        uint32_t entry_index;
+        uint32_t pd_index = address_space_pd(clone, i, &entry_index);
+        uintptr_t pd = (uintptr_t)paging_kmap(KMAP_SLOT_PAGING, pd_index);
+        write_entry(pd + entry_index * (boot_pae_enabled ? sizeof(uint64_t) : sizeof(uint32_t)),
+            PTE_MAKE(tables[table], pde & (PTE_PRESENT | PTE_WRITABLE | PTE_USER)));
+        paging_kunmap(KMAP_SLOT_PAGING);
+        table++;
+    }
+    kfree(tables);
+
+    // The parent's pages lost their write permission, user entries aren't global
+    load_pd(current_page_directory);
+    return clone;
 }
 
-inline void load_pd_phys_addr(uintptr_t pd_phys_addr)
+// The entry's address in a kmapped page table, 0 when the page table is missing
+// and can't (or shouldn't) be allocated. The table stays mapped in KMAP_SLOT_TABLE
+static uintptr_t map_entry_in(uintptr_t page_directory, uint32_t virtual_page_index, bool allocate, bool user)
 {
+    uint32_t entry_size = boot_pae_enabled ? sizeof(uint64_t) : sizeof(uint32_t);
+    uint32_t pde_index = virtual_page_index / ENTRIES_PER_TABLE;
+    if (pde_index >= KERNEL_FIRST_PDE)
+        return 0; // the kernel half is the same everywhere
+
+    uint32_t entry_index;
+    uint32_t pd_index = address_space_pd(page_directory, pde_index, &entry_index);
+    uintptr_t pde = (uintptr_t)paging_kmap(KMAP_SLOT_PAGING, pd_index) + entry_index * entry_size;
+    pte_t entry = read_entry(pde);
+
+    if (!(entry & PTE_PRESENT) && allocate)
+    {
+        uint32_t table_index = pmm_allocate_zeroed_page(PAGE_TYPE_PAGE_TABLE);
+        if (table_index != 0)
+        {
+            entry = PTE_MAKE(table_index, PTE_PRESENT | PTE_WRITABLE);
+            write_entry(pde, entry);
+        }
+    }
+    if ((entry & PTE_PRESENT) && user && !(entry & PTE_USER))
+    {
+        entry |= PTE_USER;
+        write_entry(pde, entry);
+    }
+    paging_kunmap(KMAP_SLOT_PAGING);
+
+    if (!(entry & PTE_PRESENT))
+        return 0;
+    return (uintptr_t)paging_kmap(KMAP_SLOT_TABLE, PTE_FRAME(entry)) +
+        (virtual_page_index % ENTRIES_PER_TABLE) * entry_size;
+}
+
+pte_t paging_get_entry_in(uintptr_t page_directory, uint32_t virtual_page_index)
+{
+    uintptr_t pte = map_entry_in(page_directory, virtual_page_index, false, false);
+    if (pte == 0)
+        return 0;
+
+    pte_t entry = read_entry(pte);
+    paging_kunmap(KMAP_SLOT_TABLE);
+    return entry;
+}
+
+bool paging_map_page_in(uintptr_t page_directory, uint32_t physical_page_index, uint32_t virtual_page_index,
+    pte_t flags)
+{
+    uintptr_t pte = map_entry_in(page_directory, virtual_page_index, true, flags & PTE_USER);
+    if (pte == 0)
+        return false;
+
+    write_entry(pte, PTE_MAKE(physical_page_index, flags | PTE_PRESENT));
+    paging_kunmap(KMAP_SLOT_TABLE);
+    if (page_directory == current_page_directory)
+        paging_flush_tlb_page(virtual_page_index);
+    return true;
+}
+
+bool paging_copy_to_address_space(uintptr_t page_directory, uintptr_t address, const void* buffer, size_t size,
+    pte_t flags)
+{
+    const uint8_t* source = buffer;
+    while (size > 0)
+    {
+        uint32_t virtual_page_index = address / PAGE_SIZE;
+        uint32_t offset = address % PAGE_SIZE;
+        uint32_t chunk = PAGE_SIZE - offset < size ? PAGE_SIZE - offset : size;
+
+        pte_t entry = paging_get_entry_in(page_directory, virtual_page_index);
+        uint32_t page_index = PTE_FRAME(entry);
+        if (entry & PTE_SWAP)
+            return false;
+        if ((entry & PTE_PRESENT) && !(entry & PTE_WRITABLE))
+            return false; // copy-on-write or shared with other processes
+        // Written behind the cpu's back, reclaim has to see it as dirty
+        if ((entry & PTE_PRESENT) && !(entry & PTE_DIRTY))
+        {
+            uintptr_t pte = map_entry_in(page_directory, virtual_page_index, false, false);
+            write_entry(pte, entry | PTE_DIRTY);
+            paging_kunmap(KMAP_SLOT_TABLE);
+        }
+        else if (!(entry & PTE_PRESENT))
+        {
+            page_index = pmm_allocate_zeroed_page(PAGE_TYPE_USER_ANON);
+            if (page_index == 0)
+                return false;
+            if (!paging_map_page_in(page_directory, page_index, virtual_page_index, flags | PTE_DIRTY))
+            {
+                pmm_deallocate_page(page_index);
+                return false;
+            }
+        }
+
+        uint8_t* page = paging_kmap(KMAP_SLOT_COPY, page_index);
+        memcpy(page + offset, source, chunk);
+        paging_kunmap(KMAP_SLOT_COPY);
+
+        address += chunk;
+        source += chunk;
+        size -= chunk;
+    }
+    return true;
+}
+
+bool paging_scan_user_pages(uintptr_t page_directory, uint32_t* virtual_page_index, paging_scan_fn scan,
+    void* context)
+{
+    uint32_t entry_size = boot_pae_enabled ? sizeof(uint64_t) : sizeof(uint32_t);
+
+    for (uint32_t pde_index = *virtual_page_index / ENTRIES_PER_TABLE; pde_index < KERNEL_FIRST_PDE; pde_index++)
+    {
+        uint32_t entry_index;
+        uint32_t pd_index = address_space_pd(page_directory, pde_index, &entry_index);
+        pte_t pde = read_entry((uintptr_t)paging_kmap(KMAP_SLOT_PAGING, pd_index) + entry_index * entry_size);
+        paging_kunmap(KMAP_SLOT_PAGING);
+
+        if (pde & PTE_PRESENT)
+        {
+            uintptr_t table = (uintptr_t)paging_kmap(KMAP_SLOT_TABLE, PTE_FRAME(pde));
+            for (uint32_t i = *virtual_page_index % ENTRIES_PER_TABLE; i < ENTRIES_PER_TABLE; i++)
+            {
+                uint32_t page = pde_index * ENTRIES_PER_TABLE + i;
+                pte_t entry = read_entry(table + i * entry_size);
+                if (!(entry & PTE_PRESENT))
+                    continue;
+
+                pte_t new_entry = entry;
+                bool go_on = scan(page, &new_entry, context);
+                if (new_entry != entry)
+                {
+                    write_entry(table + i * entry_size, new_entry);
+                    if (page_directory == current_page_directory)
+                        paging_flush_tlb_page(page);
+                }
+                if (!go_on)
+                {
+                    paging_kunmap(KMAP_SLOT_TABLE);
+                    *virtual_page_index = page + 1;
+                    return false;
+                }
+            }
+            paging_kunmap(KMAP_SLOT_TABLE);
+        }
+        *virtual_page_index = (pde_index + 1) * ENTRIES_PER_TABLE;
+    }
+    return true;
+}
+
+bool paging_handle_cow_fault(uint32_t virtual_page_index)
+{
+    pte_t entry = paging_get_entry(virtual_page_index);
+    if (!(entry & PTE_PRESENT) || !(entry & PTE_COW))
+        return false;
+
+    uint32_t page_index = PTE_FRAME(entry);
+    pte_t flags = (entry & ~(PTE_FRAME_MASK | PTE_COW)) | PTE_WRITABLE;
+
+    // The last one sharing the frame just takes it
+    struct page* page = pmm_get_page(page_index);
+    if (page != NULL && page->ref_count == 1)
+    {
+        paging_set_entry(virtual_page_index, PTE_MAKE(page_index, flags));
+        paging_flush_tlb_page(virtual_page_index);
+        return true;
+    }
+
+    uint32_t copy_index = pmm_allocate_page(PAGE_TYPE_USER_ANON);
+    if (copy_index == 0)
+        return false;
+
+    // The shared page is still mapped here, read only
+    void* copy = paging_kmap(KMAP_SLOT_FAULT, copy_index);
+    memcpy(copy, (void*)(virtual_page_index * PAGE_SIZE), PAGE_SIZE);
+    paging_kunmap(KMAP_SLOT_FAULT);
+
+    paging_set_entry(virtual_page_index, PTE_MAKE(copy_index, flags));
+    paging_flush_tlb_page(virtual_page_index);
+    pmm_page_unref(page_index);
+    return true;
+}
+
+// Drop the references of a page table to its pages, shared (copy-on-write) ones stay for the others
+static void free_user_pages(uint32_t table_index)
+{
+    void* table = paging_kmap(KMAP_SLOT_TABLE, table_index);
+    for (uint32_t i = 0; i < ENTRIES_PER_TABLE; i++)
+    {
+        pte_t entry = boot_pae_enabled ? ((uint64_t*)table)[i] : ((uint32_t*)table)[i];
+        if (entry & PTE_PRESENT)
+            pmm_page_unref(PTE_FRAME(entry));
+        else if (entry & PTE_SWAP)
+            swap_slot_put(PTE_FRAME(entry));
+    }
+    paging_kunmap(KMAP_SLOT_TABLE);
+}
+
+// Free the user page tables of one page directory, and their pages
+static void free_user_page_tables(uint32_t pd_index, uint32_t entries)
+{
+    void* pd = paging_kmap(KMAP_SLOT_PAGING, pd_index);
+    for (uint32_t i = 0; i < entries; i++)
+    {
+        pte_t entry = boot_pae_enabled ? ((uint64_t*)pd)[i] : ((uint32_t*)pd)[i];
+        if (entry & PTE_PRESENT)
+        {
+            free_user_pages(PTE_FRAME(entry));
+            pmm_page_unref(PTE_FRAME(entry));
+        }
+    }
+    paging_kunmap(KMAP_SLOT_PAGING);
+}
+
+void paging_free_address_space(uintptr_t page_directory)
+{
+    if (page_directory == 0 || page_directory == KERNEL_PAGE_DIR_PHYS_ADDR)
+        return;
+
+    if (boot_pae_enabled)
+    {
+        uint32_t pd_indexes[PAE_PAGE_DIRS];
+        uint64_t* pdpt = paging_kmap(KMAP_SLOT_PAGING, page_directory / PAGE_SIZE);
+        for (uint32_t i = 0; i < PAE_PAGE_DIRS; i++)
+        {
+            pd_indexes[i] = PTE_FRAME(pdpt[i]);
+        }
+        paging_kunmap(KMAP_SLOT_PAGING);
+
+        // The first 3 page directories are all user space
+        for (uint32_t i = 0; i < PAE_PAGE_DIRS; i++)
+        {
+            if (i < PAE_PAGE_DIRS - 1)
+                free_user_page_tables(pd_indexes[i], PAE_ENTRIES_PER_TABLE);
+            pmm_page_unref(pd_indexes[i]);
+        }
+    }
+    else
+    {
+        free_user_page_tables(page_directory / PAGE_SIZE, KERNEL_FIRST_PDE);
+    }
+    pmm_page_unref(page_directory / PAGE_SIZE);
+}
+
+inline void load_pd(uintptr_t page_directory)
+{
+    current_page_directory = page_directory;
     asm volatile (
         "mov %0, %%cr3"
         :
-        : "r"(pd_phys_addr)
+        : "r"(page_directory)
         : "memory"
     );
 }
 
-inline page_directory_entry* get_current_pd()
+inline uintptr_t get_current_pd()
 {
     return current_page_directory;
 }
 
-struct page_directory_entry* get_kernel_pd()
+inline uintptr_t get_kernel_pd()
 {
-    return (struct page_directory_entry*)(KERNEL_PAGE_DIR_PHYS_ADDR + RELOCATION_OFFSET);
-}
-
-inline uintptr_t get_current_pd_phys_addr() {
-    uintptr_t cr3_reg;
-    asm volatile ("mov %%cr3, %0" : "=r" (cr3_reg));
-    return cr3_reg;
+    return KERNEL_PAGE_DIR_PHYS_ADDR;
 }
@@ -6,60 +6,147 @@
 #define KERNEL_VIRT_ADDR 0xC0100000
 #define RELOCATION_OFFSET (KERNEL_VIRT_ADDR - KERNEL_PHYS_ADDR)
 
-typedef struct page_directory_entry
-{
-    uint8_t present : 1;
-    uint8_t read_write : 1;
-    uint8_t user_supervisor : 1;
-    uint8_t write_through : 1;
-    uint8_t cache_disabled : 1;
-    uint8_t accessed : 1;
-    uint8_t reserved : 1;
-    uint8_t page_size : 1;
-    uint8_t global : 1;
-
-    uint8_t available : 3;
-    uint32_t table_entry_address : 20;
-} __attribute__((packed)) page_directory_entry;
-
-
-typedef struct page_table_entry
-{
-    uint8_t present : 1;
-    uint8_t read_write : 1;
-    uint8_t user_supervisor : 1;
-    uint8_t write_through : 1;
-    uint8_t cache_disabled : 1;
-    uint8_t accessed : 1;
-    uint8_t reserved : 1;
-    uint8_t dirty : 1;
-    uint8_t global : 1;
-
-    uint8_t available : 3;
-    uint32_t physical_page_address : 20;
-} __attribute__((packed)) page_table_entry;
-
-#define PAGES_PER_TABLE 1024
-#define PAGES_PER_DIR	1024
-
-// Helper functions
-page_table_entry* get_pte(uint32_t virtual_page_index);
+// Single page windows for frames that have no permanent kernel mapping
+#define KMAP_WINDOW_ADDR 0xEFC00000
+// The struct page array of the physical memory manager (up to 48 MB for 16 GB of memory)
+#define PAGE_DATABASE_ADDR 0xF0000000
+
+// Every user of the kmap window gets its own slot. Slots are only used with
+// interrupts disabled, so one slot is never in use twice
+typedef enum {
+    KMAP_SLOT_ZERO,
+    KMAP_SLOT_PAGING,
+    KMAP_SLOT_FAULT,
+    KMAP_SLOT_TABLE,
+    KMAP_SLOT_COPY,
+    KMAP_SLOT_SWAP,
+    KMAP_SLOT_COUNT
+} kmap_slot_t;
+
+// Page table entries are 32 bit in the classic mode and 64 bit in PAE mode,
+// both are handled as 64 bit values with the same flag bits
+typedef uint64_t pte_t;
+
+// How many pages paging_allocate_range allocates and maps at a time
+#define MAP_BATCH_SIZE 64
+
+// TLB invalidations queued while unmapping, done at once by paging_flush_batch_commit:
+// invlpg per page up to the threshold, one full flush above it.
+// Only for pages of the loaded address space, the others go away with the next cr3 load
+#define FLUSH_BATCH_RANGES 8
+#define FLUSH_BATCH_PAGES_THRESHOLD 32
+
+// Gets a present user entry for paging_scan_user_pages and can change it.
+// Returns false to stop the scan after this entry
+typedef bool (*paging_scan_fn)(uint32_t virtual_page_index, pte_t* entry, void* context);
+
+typedef struct {
+    uint32_t first_page[FLUSH_BATCH_RANGES];
+    uint32_t page_amount[FLUSH_BATCH_RANGES];
+    uint32_t range_count;
+    uint32_t total_pages;
+    bool kernel;    // a global page is queued, reloading cr3 isn't enough
+} paging_flush_batch_t;
+
+#define PTE_PRESENT         0x001
+#define PTE_WRITABLE        0x002
+#define PTE_USER            0x004
+#define PTE_WRITE_THROUGH   0x008
+#define PTE_CACHE_DISABLED  0x010
+#define PTE_ACCESSED        0x020
+#define PTE_DIRTY           0x040
+#define PTE_LARGE           0x080   // in a page directory entry
+#define PTE_GLOBAL          0x100
+#define PTE_COW             0x200   // ignored by the cpu: a shared read only page that's copied on write
+#define PTE_SWAP            0x400   // in a non present entry: swapped out, the frame bits hold the swap slot
+#define PTE_NX              (1ULL << 63) // dropped unless PAE mode has the NX bit
+#define PTE_FRAME_MASK      0x000FFFFFFFFFF000ULL
+
+#define PTE_FRAME(entry) ((uint32_t)(((entry) & PTE_FRAME_MASK) >> 12))
+#define PTE_MAKE(physical_page_index, flags) (((pte_t)(physical_page_index) << 12) | (flags))
+
+// Picked by boot.asm with CPUID before paging is enabled
+bool paging_pae_enabled();
+bool paging_nx_enabled();
+// Large pages are 4 MB, or 2 MB in PAE mode. The boot mapping of the kernel uses them when they exist
+bool paging_large_pages_enabled();
+uint32_t paging_large_page_pages();
+// Kernel half mappings are global (CR4.PGE), a cr3 reload doesn't flush them
+bool paging_global_pages_enabled();
 
 // Memory mapping in paging
-void paging_map_page(uint32_t physical_page_index, uint32_t virtual_page_index, bool user_permission,
-    uintptr_t page_table_phys_addr);
-void paging_map_kernel_page(uint32_t physical_page_index, uint32_t virtual_page_index, 
-    bool user_permission);
+// Missing user page tables are allocated (zeroed), the kernel's are preallocated
+bool paging_map_page(uint32_t physical_page_index, uint32_t virtual_page_index, bool only_kernel_mode);
+bool paging_map_page_flags(uint32_t physical_page_index, uint32_t virtual_page_index, pte_t flags);
+void paging_map_kernel_page(uint32_t physical_page_index, uint32_t virtual_page_index,
+    bool supervisor_permissions);
+// Batched versions for long runs of pages
+bool paging_map_range(uint32_t first_virtual_page_index, const uint32_t* physical_pages, uint32_t count,
+    pte_t flags);
+bool paging_allocate_range(uint32_t first_virtual_page_index, uint32_t count, pte_t flags, page_type_t type);
+void paging_free_range(uint32_t first_virtual_page_index, uint32_t count);
 void paging_unmap_page(uint32_t virtual_page_index);
+void paging_flush_tlb_page(uint32_t virtual_page_index);
+// Flushes the whole TLB, global entries included
+void paging_flush_tlb_all();
+// Only flips CR4.PGE (turning it off flushes the global entries), for measuring it
+void paging_set_global_pages(bool enabled);
+// Both page indexes must be aligned to a large page, fails if small pages are mapped there
+bool paging_map_large_page(uint32_t physical_page_index, uint32_t virtual_page_index, pte_t flags);
+void paging_unmap_large_page(uint32_t virtual_page_index);
+
+// Raw entries of the current address space, 0 if the page table doesn't exist.
+// Inside a large page they are made up as if it was split into small pages
+pte_t paging_get_entry(uint32_t virtual_page_index);
+void paging_set_entry(uint32_t virtual_page_index, pte_t entry);
+
+// Creates the kmap window's page table, must run before the first process is created
+void paging_kmap_init();
+void paging_free_boot_page_tables();
+// Puts the kernel page tables of a range in the kernel PD, so address spaces created
+// later share them even if the range is mapped while another address space is loaded
+void paging_link_kernel_tables(uint32_t first_virtual_page_index, uint32_t page_amount);
+void* paging_kmap(kmap_slot_t slot, uint32_t physical_page_index);
+void paging_kunmap(kmap_slot_t slot);
+
+void paging_flush_batch_init(paging_flush_batch_t* batch);
+void paging_flush_batch_add(paging_flush_batch_t* batch, uint32_t first_virtual_page_index, uint32_t page_amount);
+void paging_flush_batch_commit(paging_flush_batch_t* batch);
 
 // Physical memory wrappers
-uintptr_t get_physical_address(void* virtual_address);
-bool allocate_kernel_virtual_page(uint32_t virtual_page_index, bool supervisor_permissions);
+uint64_t get_physical_address(void* virtual_address);
+bool allocate_kernel_virtual_page(uint32_t virtual_page_index, bool supervisor_permissions, page_type_t type);
+// Doesn't flush the TLB, queue the page in a flush batch
 void deallocate_virtual_page(uint32_t virtual_page_index);
 
+// Address spaces are known by the physical address loaded to cr3
+// (the page directory, or the PDPT in PAE mode)
+uintptr_t paging_create_address_space();
+// Frees everything in the user half (pages, page tables) and the page directories.
+// Must not be the loaded address space
+void paging_free_address_space(uintptr_t page_directory);
+// Copy-on-write copy of the loaded address space: every user frame is shared read only,
+// only the page tables are copied
+uintptr_t paging_clone_address_space();
+// Gives the loaded address space its own writable copy of a copy-on-write page
+bool paging_handle_cow_fault(uint32_t virtual_page_index);
+
+// The user half of an address space that isn't loaded, reached through the kmap window
+// instead of switching cr3. A missing page table is allocated
+pte_t paging_get_entry_in(uintptr_t page_directory, uint32_t virtual_page_index);
+bool paging_map_page_in(uintptr_t page_directory, uint32_t physical_page_index, uint32_t virtual_page_index,
+    pte_t flags);
+// Copies to user memory of another address space, mapping zeroed pages with `flags` where there are none.
+// Fails on a swapped out page, only its own process faults it back in
+bool paging_copy_to_address_space(uintptr_t page_directory, uintptr_t address, const void* buffer, size_t size,
+    pte_t flags);
+// Clock hand over the present user pages of any address space, from *virtual_page_index up.
+// Returns true when it reached the end of the user half, otherwise *virtual_page_index
+// is where to continue. Uses KMAP_SLOT_PAGING and KMAP_SLOT_TABLE while `scan` runs
+bool paging_scan_user_pages(uintptr_t page_directory, uint32_t* virtual_page_index, paging_scan_fn scan,
+    void* context);
+
 // Basic functions in paging
-struct page_directory_entry* get_current_pd();
-struct page_directory_entry* get_kernel_pd();
-void load_pd(struct page_directory_entry* pd);
-void load_pd_phys_addr(uintptr_t pd_phys_addr);
-uintptr_t get_current_pd_phys_addr();
+uintptr_t get_current_pd();
+uintptr_t get_kernel_pd();
+void load_pd(uintptr_t page_directory);
@@ -1,153 +1,646 @@
 #include "physical_memory_manager.h"
+#include "memory/paging/paging.h"
+#include "cpu/idt/idt.h"
+#include "cpu/tsc/tsc.h"
 
-#define PAGE_SIZE           4096            // 4 KB pages
 #define PAGE_SIZE_BITS      12             // 2^12 = 4096
-#define MAX_PHYSICAL_MEMORY (4ULL * 1024 * 1024 * 1024)  // 4 GB
+#define MAX_PHYSICAL_MEMORY (16ULL * 1024 * 1024 * 1024) // 16 GB with PAE
+#define MAX_LEGACY_PHYSICAL_MEMORY (4ULL * 1024 * 1024 * 1024) // 4 GB without
 #define PAGES_PER_DWORD     32             // bits in uint32_t
-#define BITMAP_SIZE         ((MAX_PHYSICAL_MEMORY / PAGE_SIZE + PAGES_PER_DWORD - 1) / PAGES_PER_DWORD)
+// The bitmaps are sized from the memory map and put in the reserved low memory, after
+// the kernel image and below the boot page tables. About 1 MB for 16 GB of memory
+#define BITMAP_POOL_PHYS_END  0x01100000
+
+#define RESERVED_MEMORY_END 0x1800000      // first 24 megabyte hold the kernel, its page tables and the bitmaps
+
+// From the linker script, the physical address the kernel image (boot stack included) ends at
+extern char kernel_physical_end[];
 
 static pmm_info_t pmm_info = {0};
 
 static bool is_initialized = false;
 
+static uint32_t zero_pool[ZERO_POOL_SIZE];
+static uint32_t zero_pool_count = 0;
+static pmm_zero_pool_stats_t zero_pool_stats = {0};
+
+static void free_area_set(pmm_free_area_t* area, uint32_t block_index);
+static void free_area_clear(pmm_free_area_t* area, uint32_t block_index);
+static bool free_area_test(const pmm_free_area_t* area, uint32_t block_index);
+static int free_area_find(pmm_free_area_t* area);
+static int free_area_find_lowest(const pmm_free_area_t* area);
+static uint32_t take_block(uint32_t block_order, uint32_t block_index, uint32_t order, page_type_t type);
+static void reserve_page(uint32_t page_index);
+static bool init_page_database();
+static uint32_t place_bitmap_pool(multiboot_info_t* mbi, uint32_t size);
+static void zero_frame(uint32_t page_index);
+
 pmm_status_t pmm_init(multiboot_info_t *mbi) {
     // Chekc if already initialized
     if (!mbi || is_initialized) {
         return PMM_ERROR_ALREADY_INITIALIZED;
     }
 
-    // Calculate the total memory from the multiboot_info
-    uint64_t total_memory = 1024 + mbi->mem_lower + (uint64_t)mbi->mem_upper*64;
-    total_memory *= 1024; // Convert to bytes
+    // Get the start and end of the memory map
+    multiboot_memory_map_t* mmap_start = (multiboot_memory_map_t*) mbi->mmap_addr;
+    multiboot_memory_map_t* mmap_end = (multiboot_memory_map_t*) (mbi->mmap_addr + mbi->mmap_length);
+    multiboot_memory_map_t* mmap;
 
-    // Calculate bitmap dimentions
-    pmm_info.max_pages = total_memory / PAGE_SIZE;
-    pmm_info.bitmap_size = pmm_info.max_pages / PAGES_PER_DWORD;
+    // The bitmaps only have to cover up to the end of the highest available region
+    uint64_t total_memory = 0;
+    for (mmap = mmap_start; mmap < mmap_end; mmap = (multiboot_memory_map_t*) ((uint32_t)mmap + mmap->size + sizeof(mmap->size))) {
+        uint64_t region_end = ((uint64_t)mmap->addr_high << 32 | mmap->addr_low) +
+            ((uint64_t)mmap->len_high << 32 | mmap->len_low);
+        if (mmap->type == 1 && region_end > total_memory)
+        {
+            total_memory = region_end;
+        }
+    }
+    // Frames above 4 GB can only be mapped in PAE mode
+    uint64_t max_memory = paging_pae_enabled() ? MAX_PHYSICAL_MEMORY : MAX_LEGACY_PHYSICAL_MEMORY;
+    if (total_memory > max_memory)
+    {
+        total_memory = max_memory;
+    }
 
-    // Allocate a bitmap
-    static uint32_t bitmap[BITMAP_SIZE];
-    pmm_info.bitmap = bitmap;
+    pmm_info.max_pages = total_memory >> PAGE_SIZE_BITS;
+    // Everything is occupied until the memory map frees it
     pmm_info.used_pages = pmm_info.max_pages;
 
-    // Set all memory to be occupied
-    memset(pmm_info.bitmap, 0xff, BITMAP_SIZE);
+    // Size the bitmaps of every order, then carve them out of one pool
+    uint32_t pool_size = 0;
+    for (uint32_t order = 0; order <= PMM_MAX_ORDER; order++)
+    {
+        pmm_free_area_t* area = &pmm_info.free_areas[order];
+        uint32_t blocks = (pmm_info.max_pages + (1U << order) - 1) >> order;
 
-    
-    // Get the start and end of the memory map
-    multiboot_memory_map_t* mmap = (multiboot_memory_map_t*) mbi->mmap_addr;
-    multiboot_memory_map_t* mmap_end = (multiboot_memory_map_t*) (mbi->mmap_addr + mbi->mmap_length);
+        area->bitmap_size = (blocks + PAGES_PER_DWORD - 1) / PAGES_PER_DWORD;
+        area->summary_size = (area->bitmap_size + PAGES_PER_DWORD - 1) / PAGES_PER_DWORD;
+        pool_size += (area->bitmap_size + area->summary_size) * sizeof(uint32_t);
+    }
+
+    uint32_t pool_address = place_bitmap_pool(mbi, pool_size);
+    if (pool_address == 0)
+    {
+        return PMM_ERROR_OUT_OF_MEMORY;
+    }
+    uint32_t* pool = (uint32_t*)(pool_address + RELOCATION_OFFSET);
+    memset(pool, 0, pool_size);
+
+    for (uint32_t order = 0; order <= PMM_MAX_ORDER; order++)
+    {
+        pmm_free_area_t* area = &pmm_info.free_areas[order];
+        area->bitmap = pool;
+        pool += area->bitmap_size;
+        area->summary = pool;
+        pool += area->summary_size;
+        area->next_fit = 0;
+        area->free_blocks = 0;
+    }
 
     // Iterate through memory map entries
-    for (; mmap < mmap_end; mmap = (multiboot_memory_map_t*) ((uint32_t)mmap + mmap->size + sizeof(mmap->size))) {
+    for (mmap = mmap_start; mmap < mmap_end; mmap = (multiboot_memory_map_t*) ((uint32_t)mmap + mmap->size + sizeof(mmap->size))) {
         if (mmap->type == 1)
         {
-            pmm_init_region(mmap->addr_low, mmap->len_low);
+            // pmm_init_region clips it to max_pages
+            pmm_init_region((uint64_t)mmap->addr_high << 32 | mmap->addr_low,
+                (uint64_t)mmap->len_high << 32 | mmap->len_low);
         }
     }
 
     // Mark first 24 megabyte as reserved
-    pmm_clear_region(0x0, 0x1800000);
+    pmm_clear_region(0x0, RESERVED_MEMORY_END);
+
+    if (!init_page_database())
+    {
+        return PMM_ERROR_OUT_OF_MEMORY;
+    }
 
     is_initialized = true;
-    set_occupied(0);
     return PMM_SUCCESS;
 }
 
 // Initialzie a memory region to available
-void pmm_init_region(uint32_t address, uint32_t length) {
-    uint32_t start_page = address / PAGE_SIZE;
-    uint32_t num_pages = length / PAGE_SIZE;
+void pmm_init_region(uint64_t address, uint64_t length) {
+    uint64_t first_page = (address + PAGE_SIZE - 1) >> PAGE_SIZE_BITS;
+    uint64_t last_page = (address + length) >> PAGE_SIZE_BITS;
 
-    for (uint32_t i = 0; i < num_pages; i++) {
-        set_free(start_page + i);
-    }
+    if (first_page >= pmm_info.max_pages)
+        return;
+    uint32_t page = first_page;
+    uint32_t end_page = last_page > pmm_info.max_pages ? pmm_info.max_pages : last_page;
+
+    // Hand the region to the buddy allocator in the largest aligned blocks that fit
+    while (page < end_page)
+    {
+        uint32_t order = 0;
+        while (order < PMM_MAX_ORDER && !(page & ((2U << order) - 1)) && page + (2U << order) <= end_page)
+            order++;
 
-    // Update the number of used pages
-    pmm_info.used_pages -= num_pages;
+        pmm_free_order(page, order);
+        page += 1U << order;
+    }
 }
 
 // deinitialzie a memory region to unavailable
-void pmm_clear_region(uint32_t address, uint32_t length) {
-    uint32_t start_page = address / PAGE_SIZE;
-    uint32_t num_pages = length / PAGE_SIZE;
+void pmm_clear_region(uint64_t address, uint64_t length) {
+    uint64_t start_page = address >> PAGE_SIZE_BITS;
+    uint64_t num_pages = length >> PAGE_SIZE_BITS;
+
+    for (uint64_t i = 0; i < num_pages && start_page + i < pmm_info.max_pages; i++) {
+        if (!check_if_occupied(start_page + i))
+        {
+            reserve_page(start_page + i);
+        }
+    }
+}
 
-    for (uint32_t i = 0; i < num_pages; i++) {
-        set_occupied(start_page + i);
+// A page is free when one of the free blocks contains it
+bool check_if_occupied(uint32_t page_index) {
+    if (page_index >= pmm_info.max_pages)
+        return true;
+
+    for (uint32_t order = 0; order <= PMM_MAX_ORDER; order++)
+    {
+        if (free_area_test(&pmm_info.free_areas[order], page_index >> order))
+            return false;
     }
+    return true;
+}
 
-    // Update the number of used pages
-    pmm_info.used_pages += num_pages;
+// allocate 2^order contiguous pages, aligned to their size
+uint32_t pmm_allocate_order(uint32_t order, page_type_t type) {
+    if (order > PMM_MAX_ORDER)
+        return 0;
+
+    // Find the smallest order that has a free block
+    uint32_t current_order = order;
+    while (current_order <= PMM_MAX_ORDER && pmm_info.free_areas[current_order].free_blocks == 0)
+        current_order++;
+
+    if (current_order > PMM_MAX_ORDER)
+        return 0; // out of memory
+
+    int block_index = free_area_find(&pmm_info.free_areas[current_order]);
+    if (block_index == -1)
+        return 0;
+
+    return take_block(current_order, block_index, order, type);
+}
+
+// Allocate a single page below 4 GB, for tables the cpu only takes a 32 bit address of
+uint32_t pmm_allocate_low_page(page_type_t type) {
+    for (uint32_t order = 0; order <= PMM_MAX_ORDER; order++)
+    {
+        int block_index = free_area_find_lowest(&pmm_info.free_areas[order]);
+        if (block_index != -1 && ((uint32_t)block_index << order) < PMM_LOW_MEMORY_PAGES)
+            return take_block(order, block_index, 0, type);
+    }
+    return 0;
 }
 
-// find first free block
-int find_first_free_block() {
-    if (pmm_info.used_pages == pmm_info.max_pages)
-        return -1;
+// Take a free block out of its free area and split it down to `order`
+static uint32_t take_block(uint32_t block_order, uint32_t block_index, uint32_t order, page_type_t type)
+{
+    free_area_clear(&pmm_info.free_areas[block_order], block_index);
+
+    // Split it, keeping the lower half and freeing the upper buddy of every level
+    while (block_order > order)
+    {
+        block_order--;
+        block_index <<= 1;
+        free_area_set(&pmm_info.free_areas[block_order], block_index + 1);
+    }
+
+    uint32_t page_index = block_index << order;
+    pmm_info.used_pages += 1U << order;
+
+    if (pmm_info.pages)
+    {
+        for (uint32_t i = 0; i < (1U << order); i++)
+        {
+            pmm_info.pages[page_index + i].ref_count = 1;
+            pmm_info.pages[page_index + i].type = type;
+        }
+        pmm_info.type_counts[PAGE_TYPE_FREE] -= 1U << order;
+        pmm_info.type_counts[type] += 1U << order;
+    }
+
+    return page_index;
+}
+
+// free 2^order pages starting at page_index, merging with free buddies
+void pmm_free_order(uint32_t page_index, uint32_t order) {
+    if (order > PMM_MAX_ORDER || page_index == 0 || page_index >= pmm_info.max_pages ||
+        (page_index & ((1U << order) - 1)) || !check_if_occupied(page_index))
+        return;
+
+    pmm_info.used_pages -= 1U << order;
 
-    // loop through each 32bit size entry in the map
-    for (int entry=0; entry < pmm_info.max_pages / 32; ++entry) {
-        // check if entire entry is occupied
-        if (pmm_info.bitmap[entry] == 0xffffffff)
+    if (pmm_info.pages)
+    {
+        for (uint32_t i = 0; i < (1U << order); i++)
+        {
+            struct page* page = &pmm_info.pages[page_index + i];
+            pmm_info.type_counts[page->type]--;
+            pmm_info.type_counts[PAGE_TYPE_FREE]++;
+            memset(page, 0, sizeof(struct page));
+        }
+    }
+
+    uint32_t block_index = page_index >> order;
+    while (order < PMM_MAX_ORDER && free_area_test(&pmm_info.free_areas[order], block_index ^ 1))
+    {
+        free_area_clear(&pmm_info.free_areas[order], block_index ^ 1);
+        block_index >>= 1;
+        order++;
+    }
+
+    free_area_set(&pmm_info.free_areas[order], block_index);
+}
+
+// allocate a block (page frame)
+uint32_t pmm_allocate_page(page_type_t type) {
+    uint32_t page_index = pmm_allocate_order(0, type);
+
+    // The zero pool is the last free memory there is
+    if (page_index == 0 && zero_pool_count > 0)
+    {
+        page_index = zero_pool[--zero_pool_count];
+        pmm_set_page_type(page_index, type);
+    }
+    return page_index;
+}
+
+// Fill `pages` with `count` page indexes, taking the biggest buddy blocks that fit
+// so a long run costs one bitmap search per block instead of one per page
+bool pmm_allocate_pages(uint32_t count, uint32_t* pages, page_type_t type)
+{
+    uint32_t allocated = 0;
+    uint32_t order = PMM_MAX_ORDER;
+
+    while (allocated < count)
+    {
+        while ((1U << order) > count - allocated)
+            order--;
+
+        uint32_t page_index = pmm_allocate_order(order, type);
+        if (page_index == 0)
+        {
+            if (order > 0)
             {
+                order--; // memory is fragmented, try smaller blocks
                 continue;
             }
-        // loop through each bit
-        for (int bit=0; bit < 32; ++bit) {
-            uint32_t block_index = entry * 32 + bit;
 
-            if (block_index >= pmm_info.max_pages)
+            while (allocated > 0)
+                pmm_deallocate_page(pages[--allocated]);
+            return false;
+        }
+
+        for (uint32_t i = 0; i < (1U << order); i++)
+        {
+            pages[allocated++] = page_index + i;
+        }
+    }
+    return true;
+}
+
+// Like pmm_allocate_pages, the zero pool is used first
+bool pmm_allocate_zeroed_pages(uint32_t count, uint32_t* pages, page_type_t type)
+{
+    uint32_t flags = save_and_disable_interrupts();
+    uint32_t from_pool = 0;
+
+    while (from_pool < count && zero_pool_count > 0)
+    {
+        pages[from_pool] = zero_pool[--zero_pool_count];
+        pmm_set_page_type(pages[from_pool], type);
+        from_pool++;
+    }
+    zero_pool_stats.hits += from_pool;
+
+    bool allocated = pmm_allocate_pages(count - from_pool, &pages[from_pool], type);
+    if (allocated)
+    {
+        zero_pool_stats.misses += count - from_pool;
+        for (uint32_t i = from_pool; i < count; i++)
+        {
+            zero_frame(pages[i]);
+        }
+    }
+    else
+    {
+        for (uint32_t i = 0; i < from_pool; i++)
+        {
+            pmm_deallocate_page(pages[i]);
+        }
+    }
+
+    restore_interrupts(flags);
+    return allocated;
+}
+
+uint32_t pmm_allocate_zeroed_page(page_type_t type)
+{
+    uint32_t flags = save_and_disable_interrupts();
+    uint32_t page_index;
+
+    if (zero_pool_count > 0)
+    {
+        page_index = zero_pool[--zero_pool_count];
+        pmm_set_page_type(page_index, type);
+        zero_pool_stats.hits++;
+    }
+    else
+    {
+        zero_pool_stats.misses++;
+        page_index = pmm_allocate_order(0, type);
+        if (page_index != 0)
+            zero_frame(page_index);
+    }
+
+    restore_interrupts(flags);
+    return page_index;
+}
+
+// Called from the idle loop with interrupts enabled, one frame at a time
+// so an interrupt waits for at most one page to be zeroed
+bool pmm_refill_zero_pool()
+{
+    uint32_t flags = save_and_disable_interrupts();
+    bool refilled = false;
+
+    if (is_initialized && zero_pool_count < ZERO_POOL_SIZE)
+    {
+        uint32_t page_index = pmm_allocate_order(0, PAGE_TYPE_ZERO_POOL);
+        if (page_index != 0)
+        {
+            zero_frame(page_index);
+            zero_pool[zero_pool_count++] = page_index;
+            refilled = true;
+        }
+    }
+
+    restore_interrupts(flags);
+    return refilled;
+}
+
+inline uint32_t pmm_get_zero_pool_count()
+{
+    return zero_pool_count;
+}
+
+inline pmm_zero_pool_stats_t pmm_get_zero_pool_stats()
+{
+    return zero_pool_stats;
+}
+
+static void zero_frame(uint32_t page_index)
+{
+    uint64_t start = tsc_read();
+
+    void* page = paging_kmap(KMAP_SLOT_ZERO, page_index);
+    uint32_t count = PAGE_SIZE / sizeof(uint32_t);
+    asm volatile ("rep stosl" : "+D"(page), "+c"(count) : "a"(0) : "memory");
+    paging_kunmap(KMAP_SLOT_ZERO);
+
+    zero_pool_stats.pages_zeroed++;
+    zero_pool_stats.zeroing_cycles += tsc_read() - start;
+}
+
+// free block (page frame)
+inline void pmm_deallocate_page(uint32_t page_index) {
+    pmm_free_order(page_index, 0);
+}
+
+inline struct page* pmm_get_page(uint32_t page_index)
+{
+    if (!pmm_info.pages || page_index >= pmm_info.max_pages)
+        return NULL;
+    return &pmm_info.pages[page_index];
+}
+
+// Take another reference to an allocated page (for sharing it between mappings)
+void pmm_page_ref(uint32_t page_index)
+{
+    struct page* page = pmm_get_page(page_index);
+    if (page && page->ref_count > 0)
+        page->ref_count++;
+}
+
+// Drop a reference, the page is freed once nobody holds it. Returns the references left
+uint32_t pmm_page_unref(uint32_t page_index)
+{
+    struct page* page = pmm_get_page(page_index);
+    if (!page || page->ref_count == 0)
+        return 0;
+
+    if (--page->ref_count == 0)
+    {
+        // pmm_free_order checks the page is still allocated
+        page->ref_count = 1;
+        pmm_free_order(page_index, 0);
+        return 0;
+    }
+    return page->ref_count;
+}
+
+void pmm_set_page_type(uint32_t page_index, page_type_t type)
+{
+    struct page* page = pmm_get_page(page_index);
+    if (!page || page->ref_count == 0 || type == PAGE_TYPE_FREE || type >= PAGE_TYPE_COUNT)
+        return;
+
+    pmm_info.type_counts[page->type]--;
+    pmm_info.type_counts[type]++;
+    page->type = type;
+}
+
+uint32_t pmm_get_type_count(page_type_t type)
+{
+    if (type >= PAGE_TYPE_COUNT)
+        return 0;
+    return pmm_info.type_counts[type];
+}
+
+// Physical address for `size` bytes of bitmaps that doesn't overlap the multiboot info or
+// the memory map, they are still read after the pool is cleared. 0 if it doesn't fit
+static uint32_t place_bitmap_pool(multiboot_info_t* mbi, uint32_t size)
+{
+    const uint32_t boot_data[][2] = {
+        { (uint32_t)mbi, (uint32_t)mbi + sizeof(*mbi) },
+        { mbi->mmap_addr, mbi->mmap_addr + mbi->mmap_length },
+    };
+    uint32_t start = ((uint32_t)kernel_physical_end + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+    bool moved = true;
+    while (moved)
+    {
+        moved = false;
+        for (uint32_t i = 0; i < sizeof(boot_data) / sizeof(boot_data[0]); i++)
+        {
+            if (start < boot_data[i][1] && boot_data[i][0] < start + size)
+            {
+                start = (boot_data[i][1] + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+                moved = true;
+            }
+        }
+    }
+    return start + size <= BITMAP_POOL_PHYS_END ? start : 0;
+}
+
+// Allocate the page database and map it at PAGE_DATABASE_ADDR
+static bool init_page_database()
+{
+    uint32_t database_pages = (pmm_info.max_pages * sizeof(struct page) + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    uint32_t large_pages = paging_large_pages_enabled() ? paging_large_page_pages() : 0;
+    uint32_t i = 0;
+
+    // Large pages where they fit, one TLB entry covers a lot of the database
+    if (large_pages != 0)
+    {
+        uint32_t order = 0;
+        while ((1U << order) < large_pages)
+            order++;
+
+        for (; i + large_pages <= database_pages; i += large_pages)
+        {
+            uint32_t physical_page_index = pmm_allocate_order(order, PAGE_TYPE_RESERVED);
+            if (physical_page_index == 0)
+                break;
+            if (!paging_map_large_page(physical_page_index, PAGE_DATABASE_ADDR / PAGE_SIZE + i,
+                PTE_WRITABLE))
+            {
+                pmm_free_order(physical_page_index, order);
                 break;
+            }
+        }
+    }
 
-            if (!check_if_occupied(block_index))
-                return block_index;
+    // The rest doesn't need to be contiguous in physical memory
+    for (; i < database_pages; i++)
+    {
+        uint32_t physical_page_index = pmm_allocate_page(PAGE_TYPE_RESERVED);
+        if (physical_page_index == 0)
+        {
+            return false;
         }
+        paging_map_kernel_page(physical_page_index, PAGE_DATABASE_ADDR / PAGE_SIZE + i, true);
     }
 
-    return -1;
+    pmm_info.pages = (struct page*)PAGE_DATABASE_ADDR;
+    memset(pmm_info.pages, 0, database_pages * PAGE_SIZE);
+
+    for (uint32_t i = 0; i < pmm_info.max_pages; i++)
+    {
+        if (check_if_occupied(i))
+        {
+            pmm_info.pages[i].ref_count = 1;
+            pmm_info.pages[i].type = PAGE_TYPE_RESERVED;
+        }
+        pmm_info.type_counts[pmm_info.pages[i].type]++;
+    }
+    return true;
 }
 
-// allocate a block (page frame)
-uint32_t pmm_allocate_page() {
-    uint32_t page_index = find_first_free_block();
+// Take a single free page out of the free block that contains it
+static void reserve_page(uint32_t page_index)
+{
+    uint32_t order = 0;
+    while (!free_area_test(&pmm_info.free_areas[order], page_index >> order))
+        order++;
 
-    if (page_index == -1)
-        return 0; // out of memory
+    free_area_clear(&pmm_info.free_areas[order], page_index >> order);
+
+    // Every split frees the half that doesn't hold the page
+    while (order > 0)
+    {
+        order--;
+        free_area_set(&pmm_info.free_areas[order], (page_index >> order) ^ 1);
+    }
 
-    set_occupied(page_index);
     ++pmm_info.used_pages;
+}
 
-    return page_index;
+static void free_area_set(pmm_free_area_t* area, uint32_t block_index)
+{
+    uint32_t arr_index = block_index / PAGES_PER_DWORD;
+
+    area->bitmap[arr_index] |= 1U << (block_index % PAGES_PER_DWORD);
+    area->summary[arr_index / PAGES_PER_DWORD] |= 1U << (arr_index % PAGES_PER_DWORD);
+    area->free_blocks++;
 }
 
-// free block (page frame)
-void pmm_deallocate_page(uint32_t page_index) {
-    --pmm_info.used_pages;
-    set_free(page_index);
+static void free_area_clear(pmm_free_area_t* area, uint32_t block_index)
+{
+    uint32_t arr_index = block_index / PAGES_PER_DWORD;
+
+    area->bitmap[arr_index] &= ~(1U << (block_index % PAGES_PER_DWORD));
+    if (area->bitmap[arr_index] == 0)
+        area->summary[arr_index / PAGES_PER_DWORD] &= ~(1U << (arr_index % PAGES_PER_DWORD));
+    area->free_blocks--;
 }
 
-void set_bit_status(uint32_t bit_index, enum PAGE_STATUS status) {
-    int arr_index = bit_index / 32;
-    int shift_amount = bit_index % 32;
-    int bit_mask = 1 << shift_amount;
-    
-    if (status == MEMORY_FREE)
-        pmm_info.bitmap[arr_index] &= bit_mask;
-    else    
-        pmm_info.bitmap[arr_index] |= bit_mask;
+static bool free_area_test(const pmm_free_area_t* area, uint32_t block_index)
+{
+    uint32_t arr_index = block_index / PAGES_PER_DWORD;
+
+    if (arr_index >= area->bitmap_size)
+        return false;
+    return area->bitmap[arr_index] & (1U << (block_index % PAGES_PER_DWORD));
+}
+
+// find a free block, starting at the summary word of the last allocation (next fit)
+static int free_area_find(pmm_free_area_t* area)
+{
+    uint32_t summary_index = area->next_fit;
+
+    // loop through the summary words, wrapping around to the start once
+    for (uint32_t i = 0; i < area->summary_size; ++i) {
+        if (area->summary[summary_index] != 0)
+        {
+            uint32_t entry = summary_index * PAGES_PER_DWORD + __builtin_ctz(area->summary[summary_index]);
+
+            area->next_fit = summary_index;
+            return entry * PAGES_PER_DWORD + __builtin_ctz(area->bitmap[entry]);
+        }
+
+        if (++summary_index == area->summary_size)
+            summary_index = 0;
+    }
+
+    return -1;
 }
-void set_occupied(uint32_t bit_index)
+
+// The first free block, ignoring the next fit cursor
+static int free_area_find_lowest(const pmm_free_area_t* area)
 {
-    set_bit_status(bit_index, MEMORY_OCCUPIED);
+    for (uint32_t summary_index = 0; summary_index < area->summary_size; ++summary_index) {
+        if (area->summary[summary_index] != 0)
+        {
+            uint32_t entry = summary_index * PAGES_PER_DWORD + __builtin_ctz(area->summary[summary_index]);
+            return entry * PAGES_PER_DWORD + __builtin_ctz(area->bitmap[entry]);
+        }
+    }
+
+    return -1;
 }
-void set_free(uint32_t bit_index)
+
+inline uint32_t pmm_get_max_pages()
 {
-    set_bit_status(bit_index, MEMORY_FREE);
+    return pmm_info.max_pages;
 }
 
-bool check_if_occupied(uint32_t bit_index) {
-    int arr_index = bit_index / 32;
-    int shift_amount = bit_index % 32;
-    int bit_mask = 1 << shift_amount;
+inline uint32_t pmm_get_used_pages()
+{
+    return pmm_info.used_pages;
+}
 
-    return pmm_info.bitmap[arr_index] & bit_mask;
-}
\ No newline at end of file
+uint32_t pmm_get_free_blocks(uint32_t order)
+{
+    if (order > PMM_MAX_ORDER)
+        return 0;
+    return pmm_info.free_areas[order].free_blocks;
+}
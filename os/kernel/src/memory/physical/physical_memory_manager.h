@@ -6,6 +6,11 @@
 #include <string.h>
 #include "multiboot.h"
 
+// Largest buddy block is 2^PMM_MAX_ORDER pages (4 MB)
+#define PMM_MAX_ORDER 10
+// Pages below 4 GB
+#define PMM_LOW_MEMORY_PAGES 0x100000
+
 typedef enum {
     PMM_SUCCESS = 0,
     PMM_ERROR_INVALID_PARAMS,
@@ -13,28 +18,97 @@ typedef enum {
     PMM_ERROR_ALREADY_INITIALIZED
 } pmm_status_t;
 
-static enum PAGE_STATUS {
-    MEMORY_FREE = 0,
-    MEMORY_OCCUPIED = 1
-};
+// What a page frame is used for, for memory accounting
+typedef enum {
+    PAGE_TYPE_FREE = 0,
+    PAGE_TYPE_RESERVED,     // BIOS, kernel image, boot page tables and the page database
+    PAGE_TYPE_KERNEL,
+    PAGE_TYPE_HEAP,
+    PAGE_TYPE_PAGE_TABLE,
+    PAGE_TYPE_USER_ANON,
+    PAGE_TYPE_FILE_CACHE,
+    PAGE_TYPE_KERNEL_STACK,
+    PAGE_TYPE_ZERO_POOL,    // zeroed by the idle loop, waiting in the zero pool
+    PAGE_TYPE_SLAB,         // heap pages holding a slab of a kmem cache
+    PAGE_TYPE_COUNT
+} page_type_t;
 
+// One entry per page frame, indexed by the frame number
+struct page {
+    uint16_t ref_count;     // the frame is freed when this drops to 0
+    uint8_t type;           // page_type_t
+    union {
+        struct {
+            struct page* lru_next;  // reclaim list links
+            struct page* lru_prev;
+        };
+        void* slab;             // the slab owning a PAGE_TYPE_SLAB frame
+    };
+};
 
+// The free blocks of one order, kept as a two-level bitmap
 typedef struct {
-    uint32_t* bitmap;
+    uint32_t* bitmap;      // bit i is set when block i of this order is free
     uint32_t bitmap_size;  // in uint32_t's
+    uint32_t* summary;     // bit i is set when bitmap[i] holds a free block
+    uint32_t summary_size; // in uint32_t's
+    uint32_t next_fit;     // summary word the next search starts from
+    uint32_t free_blocks;
+} pmm_free_area_t;
+
+// Frames the idle loop zeroes ahead of time for pmm_allocate_zeroed_page
+#define ZERO_POOL_SIZE 64
+
+typedef struct {
+    uint32_t hits;            // served from the pool
+    uint32_t misses;          // zeroed inline
+    uint32_t pages_zeroed;
+    uint64_t zeroing_cycles;
+} pmm_zero_pool_stats_t;
+
+typedef struct {
+    pmm_free_area_t free_areas[PMM_MAX_ORDER + 1];
+    struct page* pages;     // the page database
+    uint32_t type_counts[PAGE_TYPE_COUNT];
     uint32_t max_pages;
     uint32_t used_pages;
 } pmm_info_t;
 
 pmm_status_t pmm_init(multiboot_info_t *mbi);
 
-void set_bit_status(uint32_t bit_index, enum PAGE_STATUS status);
-void set_occupied(uint32_t bit_index);
-void set_free(uint32_t bit_index);
-bool check_if_occupied(uint32_t bit_index);
+bool check_if_occupied(uint32_t page_index);
+
+// Physical addresses are 64 bit, memory above 4 GB is used in PAE mode
+void pmm_init_region(uint64_t address, uint64_t length);
+void pmm_clear_region(uint64_t address, uint64_t length);
+
+// Buddy allocator, returns the first page index of 2^order contiguous pages (0 on failure)
+// Every page of the block starts with a reference count of 1
+uint32_t pmm_allocate_order(uint32_t order, page_type_t type);
+void pmm_free_order(uint32_t page_index, uint32_t order);
+uint32_t pmm_allocate_low_page(page_type_t type);
+
+// Single pages are order 0 blocks
+uint32_t pmm_allocate_page(page_type_t type);
+void pmm_deallocate_page(uint32_t page_index);
+// Allocates `count` single pages at once (not contiguous), all or nothing
+bool pmm_allocate_pages(uint32_t count, uint32_t* pages, page_type_t type);
+
+// Returns a page filled with zeroes, from the zero pool when it has one
+uint32_t pmm_allocate_zeroed_page(page_type_t type);
+bool pmm_allocate_zeroed_pages(uint32_t count, uint32_t* pages, page_type_t type);
+// Zeroes one more frame for the pool, returns false when there is nothing left to do
+bool pmm_refill_zero_pool();
+uint32_t pmm_get_zero_pool_count();
+pmm_zero_pool_stats_t pmm_get_zero_pool_stats();
+
+// Page database
+struct page* pmm_get_page(uint32_t page_index);
+void pmm_page_ref(uint32_t page_index);
+uint32_t pmm_page_unref(uint32_t page_index);
+void pmm_set_page_type(uint32_t page_index, page_type_t type);
+uint32_t pmm_get_type_count(page_type_t type);
 
-void pmm_init_region(uint32_t address, uint32_t length);
-void pmm_clear_region(uint32_t address, uint32_t length);
-int find_first_free_block();
-uint32_t pmm_allocate_page();
-void pmm_deallocate_page(uint32_t page_index);
\ No newline at end of file
+uint32_t pmm_get_max_pages();
+uint32_t pmm_get_used_pages();
+uint32_t pmm_get_free_blocks(uint32_t order);
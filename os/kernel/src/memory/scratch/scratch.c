@@ -0,0 +1,90 @@
+#include "scratch.h"
+#include "memory/heap/heap.h"
+#include "memory/vmalloc/vmalloc.h"
+#include "process/manager/process_manager.h"
+
+#define SCRATCH_ARENA_SIZE (SCRATCH_ARENA_PAGES * PAGE_SIZE)
+#define ALIGN(size, alignment) (((size) + (alignment)-1) & ~((alignment)-1))
+
+// Every allocation starts with the offset of the allocation before it
+typedef struct {
+    uint32_t prev_last;
+    uint32_t reserved; // keeps the buffers 8 byte aligned
+} scratch_header_t;
+
+static scratch_arena_t kernel_arena = {0};
+static scratch_stats_t scratch_stats = {0};
+
+static scratch_arena_t* current_arena()
+{
+    process_t* process = get_current_process();
+    return process ? &process->scratch : &kernel_arena;
+}
+
+void* scratch_alloc(size_t size)
+{
+    scratch_arena_t* arena = current_arena();
+    uint32_t needed = sizeof(scratch_header_t) + ALIGN(size, 8);
+
+    if (arena->base == NULL)
+    {
+        arena->base = vmalloc(SCRATCH_ARENA_SIZE);
+    }
+    if (arena->base == NULL || needed > SCRATCH_ARENA_SIZE - arena->top)
+    {
+        scratch_stats.fallbacks++;
+        return kmalloc(size);
+    }
+
+    scratch_header_t* header = (scratch_header_t*)(arena->base + arena->top);
+    header->prev_last = arena->last;
+    arena->last = arena->top + sizeof(scratch_header_t);
+    arena->top += needed;
+
+    if (arena->top > arena->high_water)
+    {
+        arena->high_water = arena->top;
+        if (arena->top > scratch_stats.high_water)
+            scratch_stats.high_water = arena->top;
+    }
+    return arena->base + arena->last;
+}
+
+void scratch_free(void* buffer)
+{
+    scratch_arena_t* arena = current_arena();
+    uint8_t* address = buffer;
+
+    if (arena->base == NULL || address < arena->base || address >= arena->base + SCRATCH_ARENA_SIZE)
+    {
+        kfree(buffer);
+        return;
+    }
+
+    if (arena->last != 0 && address == arena->base + arena->last)
+    {
+        scratch_header_t* header = (scratch_header_t*)address - 1;
+        arena->top = arena->last - sizeof(scratch_header_t);
+        arena->last = header->prev_last;
+    }
+}
+
+void scratch_reset()
+{
+    scratch_arena_t* arena = current_arena();
+    arena->top = 0;
+    arena->last = 0;
+}
+
+void scratch_arena_destroy(scratch_arena_t* arena)
+{
+    vfree(arena->base);
+    arena->base = NULL;
+    arena->top = 0;
+    arena->last = 0;
+}
+
+scratch_stats_t scratch_get_stats()
+{
+    return scratch_stats;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Bump allocator for buffers that only live during one syscall. Every process has
+// its own arena (a process can block in the middle of a syscall), the kernel's
+// own context uses a shared one. handle_syscall resets the arena when a syscall returns
+#define SCRATCH_ARENA_PAGES 8
+
+typedef struct {
+    uint8_t* base;          // vmalloc'ed on the first use
+    uint32_t top;
+    uint32_t last;          // offset of the newest allocation, 0 when there is none
+    uint32_t high_water;
+} scratch_arena_t;
+
+typedef struct {
+    uint32_t high_water;    // of all the arenas
+    uint32_t fallbacks;     // allocations that didn't fit and went to kmalloc
+} scratch_stats_t;
+
+// Freeing the newest allocation gives its space back right away, others wait for the reset.
+// Allocations that don't fit in the arena come from kmalloc, scratch_free frees them too
+void* scratch_alloc(size_t size);
+void scratch_free(void* buffer);
+
+void scratch_reset();
+void scratch_arena_destroy(scratch_arena_t* arena);
+
+scratch_stats_t scratch_get_stats();
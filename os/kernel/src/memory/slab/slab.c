@@ -0,0 +1,223 @@
+#include "slab.h"
+#include "memory/heap/heap.h"
+#include "memory/paging/paging.h"
+
+#define ALIGN(size, alignment) (((size) + (alignment)-1) & ~((alignment)-1))
+#define SLAB_HEADER_SIZE ALIGN(sizeof(kmem_slab_t), 8)
+#define SLAB_OBJECTS(slab) ((uintptr_t)(slab) + SLAB_HEADER_SIZE)
+#define FREE_LINK(cache, object) (*(void**)((uintptr_t)(object) + (cache)->link_offset))
+
+static kmem_cache_t* cache_list = NULL;
+
+static void slab_list_add(kmem_slab_t** list, kmem_slab_t* slab)
+{
+    slab->prev = NULL;
+    slab->next = *list;
+    if (*list)
+    {
+        (*list)->prev = slab;
+    }
+    *list = slab;
+}
+
+static void slab_list_remove(kmem_slab_t** list, kmem_slab_t* slab)
+{
+    if (slab->prev)
+    {
+        slab->prev->next = slab->next;
+    }
+    else
+    {
+        *list = slab->next;
+    }
+    if (slab->next)
+    {
+        slab->next->prev = slab->prev;
+    }
+}
+
+// Tag the slab's frames so kmem_cache_free can find the slab of an object
+static void slab_set_pages(kmem_slab_t* slab, uint32_t page_amount, page_type_t type)
+{
+    for (uint32_t i = 0; i < page_amount; i++)
+    {
+        uint32_t page_index = get_physical_address((void*)((uintptr_t)slab + i * PAGE_SIZE)) / PAGE_SIZE;
+        struct page* page = pmm_get_page(page_index);
+        pmm_set_page_type(page_index, type);
+        page->slab = type == PAGE_TYPE_SLAB ? slab : NULL;
+    }
+}
+
+static kmem_slab_t* slab_create(kmem_cache_t* cache)
+{
+    kmem_slab_t* slab = kmalloc_pages(cache->slab_pages);
+    if (slab == NULL)
+    {
+        return NULL;
+    }
+
+    slab->cache = cache;
+    slab->in_use = 0;
+    slab->free_list = NULL;
+
+    // Build the free list backwards so objects are handed out in address order
+    for (uint32_t i = cache->objects_per_slab; i-- > 0; )
+    {
+        void* object = (void*)(SLAB_OBJECTS(slab) + i * cache->object_size);
+        if (cache->constructor)
+        {
+            cache->constructor(object);
+        }
+        FREE_LINK(cache, object) = slab->free_list;
+        slab->free_list = object;
+    }
+
+    slab_set_pages(slab, cache->slab_pages, PAGE_TYPE_SLAB);
+    cache->total_objects += cache->objects_per_slab;
+    return slab;
+}
+
+static void slab_destroy(kmem_cache_t* cache, kmem_slab_t* slab)
+{
+    slab_set_pages(slab, cache->slab_pages, PAGE_TYPE_KERNEL);
+    cache->total_objects -= cache->objects_per_slab;
+    kfree(slab);
+}
+
+kmem_cache_t* kmem_cache_create(const char* name, size_t object_size, void (*constructor)(void*))
+{
+    // Leaves room for the link after the object and its alignment
+    if (object_size == 0 || object_size > SLAB_MAX_PAGES * PAGE_SIZE - SLAB_HEADER_SIZE - 2 * sizeof(void*))
+    {
+        return NULL;
+    }
+
+    kmem_cache_t* cache = kmalloc(sizeof(kmem_cache_t));
+    if (cache == NULL)
+    {
+        return NULL;
+    }
+
+    // Free objects hold the free list link, in their first word unless a constructor
+    // initialized it. Then the link gets its own word after the object
+    if (constructor)
+    {
+        cache->link_offset = ALIGN(object_size, sizeof(void*));
+        cache->object_size = ALIGN(cache->link_offset + sizeof(void*), 8);
+    }
+    else
+    {
+        cache->link_offset = 0;
+        cache->object_size = ALIGN(object_size < sizeof(void*) ? sizeof(void*) : object_size, 8);
+    }
+
+    // Fewer objects per slab for big objects, so a slab stays under SLAB_MAX_PAGES
+    uint32_t objects = SLAB_MIN_OBJECTS;
+    while (objects > 1 && SLAB_HEADER_SIZE + objects * cache->object_size > SLAB_MAX_PAGES * PAGE_SIZE)
+    {
+        objects--;
+    }
+    cache->slab_pages = ALIGN(SLAB_HEADER_SIZE + objects * cache->object_size, PAGE_SIZE) / PAGE_SIZE;
+    // Use up the rounding to whole pages
+    cache->objects_per_slab = (cache->slab_pages * PAGE_SIZE - SLAB_HEADER_SIZE) / cache->object_size;
+
+    cache->name = name;
+    cache->constructor = constructor;
+    cache->partial = NULL;
+    cache->full = NULL;
+    cache->empty = NULL;
+    cache->active_objects = 0;
+    cache->total_objects = 0;
+
+    cache->next = cache_list;
+    cache_list = cache;
+    return cache;
+}
+
+void* kmem_cache_alloc(kmem_cache_t* cache)
+{
+    kmem_slab_t* slab = cache->partial;
+    if (slab == NULL)
+    {
+        slab = cache->empty;
+        if (slab)
+        {
+            slab_list_remove(&cache->empty, slab);
+        }
+        else if ((slab = slab_create(cache)) == NULL)
+        {
+            return NULL;
+        }
+        slab_list_add(&cache->partial, slab);
+    }
+
+    void* object = slab->free_list;
+    slab->free_list = FREE_LINK(cache, object);
+    slab->in_use++;
+    cache->active_objects++;
+
+    if (slab->in_use == cache->objects_per_slab)
+    {
+        slab_list_remove(&cache->partial, slab);
+        slab_list_add(&cache->full, slab);
+    }
+    return object;
+}
+
+void kmem_cache_free(kmem_cache_t* cache, void* object)
+{
+    if (object == NULL)
+    {
+        return;
+    }
+
+    struct page* page = pmm_get_page(get_physical_address(object) / PAGE_SIZE);
+    if (page == NULL || page->type != PAGE_TYPE_SLAB)
+    {
+        return;
+    }
+    kmem_slab_t* slab = page->slab;
+    if (slab->cache != cache)
+    {
+        return;
+    }
+
+    if (slab->in_use == cache->objects_per_slab)
+    {
+        slab_list_remove(&cache->full, slab);
+        slab_list_add(&cache->partial, slab);
+    }
+
+    FREE_LINK(cache, object) = slab->free_list;
+    slab->free_list = object;
+    slab->in_use--;
+    cache->active_objects--;
+
+    if (slab->in_use == 0)
+    {
+        slab_list_remove(&cache->partial, slab);
+        // One empty slab absorbs alloc/free bouncing, more are given back to the heap
+        if (cache->empty)
+        {
+            slab_destroy(cache, slab);
+        }
+        else
+        {
+            slab_list_add(&cache->empty, slab);
+        }
+    }
+}
+
+kmem_cache_stats_t kmem_cache_get_stats(const kmem_cache_t* cache)
+{
+    return (kmem_cache_stats_t){
+        .active_objects = cache->active_objects,
+        .total_objects = cache->total_objects,
+        .slabs = cache->total_objects / cache->objects_per_slab,
+    };
+}
+
+kmem_cache_t* kmem_cache_get_list()
+{
+    return cache_list;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// A slab aims to hold this many objects, as long as it stays under SLAB_MAX_PAGES
+#define SLAB_MIN_OBJECTS 8
+#define SLAB_MAX_PAGES 16
+
+// One or more heap pages, starting with this header and followed by the objects
+typedef struct kmem_slab {
+    struct kmem_slab* next;
+    struct kmem_slab* prev;
+    struct kmem_cache* cache;
+    void* free_list;        // free objects, each holding the next one at the cache's link_offset
+    uint32_t in_use;
+} kmem_slab_t;
+
+typedef struct kmem_cache {
+    const char* name;
+    size_t object_size;     // the stride of the objects in a slab
+    size_t link_offset;     // of the free list link, past the object when there is a constructor
+    uint32_t slab_pages;
+    uint32_t objects_per_slab;
+    void (*constructor)(void* object);
+    kmem_slab_t* partial;
+    kmem_slab_t* full;
+    kmem_slab_t* empty;     // at most one slab is kept around empty
+    uint32_t active_objects;
+    uint32_t total_objects;
+    struct kmem_cache* next;
+} kmem_cache_t;
+
+typedef struct {
+    uint32_t active_objects;
+    uint32_t total_objects;
+    uint32_t slabs;
+} kmem_cache_stats_t;
+
+// The constructor runs once per object when its slab is created, so objects
+// should be given back to kmem_cache_free in their constructed state. The free
+// list link is kept after the object then, so none of the constructed state is lost
+kmem_cache_t* kmem_cache_create(const char* name, size_t object_size, void (*constructor)(void*));
+void* kmem_cache_alloc(kmem_cache_t* cache);
+void kmem_cache_free(kmem_cache_t* cache, void* object);
+
+kmem_cache_stats_t kmem_cache_get_stats(const kmem_cache_t* cache);
+// All the caches, linked by `next`
+kmem_cache_t* kmem_cache_get_list();
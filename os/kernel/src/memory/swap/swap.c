@@ -0,0 +1,210 @@
+#include "swap.h"
+#include "filesystem/fat/fat.h"
+#include "process/manager/process_manager.h"
+
+#define SWAP_NO_SLOT 0xFFFFFFFF
+
+static FileData swap_file;
+static bool swap_ready = false;
+static uint16_t slot_refs[SWAP_PAGES]; // 0 when the slot is free
+static uint32_t next_free_slot = 0;    // where the search for a free slot starts
+static swap_stats_t swap_stats = {0};
+
+// The clock hand: a process, and the next page of it to look at
+static uint32_t hand_pid = 0;
+static uint32_t hand_page = 0;
+
+typedef struct {
+    uint32_t target;
+    uint32_t freed;
+    uint32_t budget;
+} reclaim_t;
+
+bool swap_init()
+{
+    if (fat_get_file_data(SWAP_FILE_PATH, &swap_file) != 0)
+    {
+        fat_create_file(SWAP_FILE_PATH);
+        if (fat_get_file_data(SWAP_FILE_PATH, &swap_file) != 0)
+            return false;
+    }
+    if (swap_file.file_entry.file_size < SWAP_PAGES * PAGE_SIZE &&
+        fat_truncate(&swap_file, SWAP_PAGES * PAGE_SIZE) != 0)
+    {
+        return false;
+    }
+    // Its clusters are written directly, a user can't free or move them
+    if (!fat_pin_file(&swap_file.file_entry))
+        return false;
+
+    swap_ready = true;
+    return true;
+}
+
+static uint32_t allocate_slot()
+{
+    if (!swap_ready)
+        return SWAP_NO_SLOT;
+
+    for (uint32_t i = 0; i < SWAP_PAGES; i++)
+    {
+        uint32_t slot = (next_free_slot + i) % SWAP_PAGES;
+        if (slot_refs[slot] == 0)
+        {
+            slot_refs[slot] = 1;
+            next_free_slot = (slot + 1) % SWAP_PAGES;
+            swap_stats.used_slots++;
+            return slot;
+        }
+    }
+    return SWAP_NO_SLOT;
+}
+
+void swap_slot_dup(uint32_t slot)
+{
+    if (slot < SWAP_PAGES && slot_refs[slot] != 0)
+        slot_refs[slot]++;
+}
+
+void swap_slot_put(uint32_t slot)
+{
+    if (slot >= SWAP_PAGES || slot_refs[slot] == 0)
+        return;
+    if (--slot_refs[slot] == 0)
+        swap_stats.used_slots--;
+}
+
+// Second chance: an accessed page loses the bit, one that wasn't accessed since is taken.
+// Only private anonymous frames, a shared one would stay mapped in the other address spaces
+static bool reclaim_entry(uint32_t virtual_page_index, pte_t* entry, void* context)
+{
+    (void)virtual_page_index;
+    reclaim_t* reclaim = context;
+    uint32_t page_index = PTE_FRAME(*entry);
+    struct page* page = pmm_get_page(page_index);
+    swap_stats.scanned++;
+
+    if (page == NULL || page->type != PAGE_TYPE_USER_ANON || page->ref_count != 1)
+        return --reclaim->budget > 0;
+
+    if (*entry & PTE_ACCESSED)
+    {
+        *entry &= ~PTE_ACCESSED;
+        swap_stats.referenced++;
+        return --reclaim->budget > 0;
+    }
+
+    if (*entry & PTE_DIRTY)
+    {
+        uint32_t slot = allocate_slot();
+        if (slot == SWAP_NO_SLOT)
+            return --reclaim->budget > 0; // clean pages can still be dropped
+
+        void* data = paging_kmap(KMAP_SLOT_SWAP, page_index);
+        bool written = fat_write(&swap_file.file_entry, &swap_file.parent_entry, slot * PAGE_SIZE, PAGE_SIZE,
+            data) == PAGE_SIZE;
+        paging_kunmap(KMAP_SLOT_SWAP);
+        if (!written)
+        {
+            swap_slot_put(slot);
+            swap_stats.io_errors++;
+            return --reclaim->budget > 0;
+        }
+        *entry = PTE_MAKE(slot, PTE_SWAP);
+        swap_stats.swap_outs++;
+    }
+    else
+    {
+        // Never written, the fault handler fills it the same way again
+        *entry = 0;
+        swap_stats.dropped++;
+    }
+
+    pmm_page_unref(page_index);
+    reclaim->freed++;
+    return reclaim->freed < reclaim->target && --reclaim->budget > 0;
+}
+
+uint32_t swap_reclaim(uint32_t page_amount)
+{
+    reclaim_t reclaim = { .target = page_amount, .freed = 0, .budget = SWAP_SCAN_BUDGET };
+    uint32_t wraps = 0;
+
+    while (reclaim.freed < reclaim.target && reclaim.budget > 0)
+    {
+        // The lowest pid from the hand up, pid 0 is never in the process list
+        process_t* process = get_next_process(hand_pid > 0 ? hand_pid - 1 : 0);
+        if (process == NULL)
+        {
+            // Two passes over everything, so the second chances run out
+            if (++wraps > 2)
+                break;
+            hand_pid = 0;
+            hand_page = 0;
+            continue;
+        }
+        if (process->pid != hand_pid)
+        {
+            hand_pid = process->pid; // the process at the hand is gone
+            hand_page = 0;
+        }
+
+        if (paging_scan_user_pages(process->page_directory, &hand_page, reclaim_entry, &reclaim))
+        {
+            hand_pid++;
+            hand_page = 0;
+        }
+    }
+    return reclaim.freed;
+}
+
+void swap_balance()
+{
+    uint32_t free_pages = pmm_get_max_pages() - pmm_get_used_pages() + pmm_get_zero_pool_count();
+    if (free_pages < SWAP_LOW_WATERMARK)
+        swap_reclaim(SWAP_RECLAIM_BATCH);
+}
+
+uint32_t swap_allocate_page(page_type_t type)
+{
+    uint32_t page_index = pmm_allocate_zeroed_page(type);
+    if (page_index == 0 && swap_reclaim(SWAP_RECLAIM_BATCH) > 0)
+        page_index = pmm_allocate_zeroed_page(type);
+    return page_index;
+}
+
+bool swap_in(uint32_t virtual_page_index, pte_t entry, pte_t flags)
+{
+    uint32_t slot = PTE_FRAME(entry);
+    if (!swap_ready || slot >= SWAP_PAGES || slot_refs[slot] == 0)
+        return false;
+
+    uint32_t page_index = swap_allocate_page(PAGE_TYPE_USER_ANON);
+    if (page_index == 0)
+        return false;
+
+    void* data = paging_kmap(KMAP_SLOT_SWAP, page_index);
+    bool read = fat_read(&swap_file.file_entry, slot * PAGE_SIZE, PAGE_SIZE, data) == PAGE_SIZE;
+    paging_kunmap(KMAP_SLOT_SWAP);
+    if (!read)
+    {
+        swap_stats.io_errors++;
+        pmm_deallocate_page(page_index);
+        return false;
+    }
+
+    // Dirty, its swap copy is given up and a clean page would be dropped instead of written
+    if (!paging_map_page_flags(page_index, virtual_page_index, flags | PTE_DIRTY))
+    {
+        pmm_deallocate_page(page_index);
+        return false;
+    }
+    swap_slot_put(slot);
+    swap_stats.swap_ins++;
+    return true;
+}
+
+swap_stats_t swap_get_stats()
+{
+    return swap_stats;
+}
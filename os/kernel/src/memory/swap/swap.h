@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "memory/paging/paging.h"
+
+// Private user pages are swapped out to a file preallocated on the FAT volume. A swapped
+// out page keeps a non present entry with PTE_SWAP, the frame bits hold its slot in the file
+#define SWAP_FILE_PATH "/swap"
+#define SWAP_PAGES 1024
+
+// Page faults reclaim a batch when fewer pages than the watermark are free
+#define SWAP_LOW_WATERMARK 256
+#define SWAP_RECLAIM_BATCH 32
+// Entries the clock hand looks at per reclaim, at most
+#define SWAP_SCAN_BUDGET 8192
+
+typedef struct {
+    uint32_t scanned;       // entries the clock hand passed
+    uint32_t referenced;    // accessed since the last pass, given a second chance
+    uint32_t dropped;       // clean, refilled from their VMA on the next fault
+    uint32_t swap_outs;     // pages written to the swap file
+    uint32_t swap_ins;      // pages read back
+    uint32_t io_errors;
+    uint32_t used_slots;
+} swap_stats_t;
+
+// Creates or reuses the swap file, reclaim only drops clean pages without it
+bool swap_init();
+
+// Frees up to `page_amount` frames from the user pages of every process, returns how many.
+// Pages the clock hand finds accessed lose the bit and are taken on its next pass
+uint32_t swap_reclaim(uint32_t page_amount);
+// Reclaims a batch if memory is low. Only where no kmap slot is in use
+void swap_balance();
+// A zeroed frame, reclaiming user pages first when there is none
+uint32_t swap_allocate_page(page_type_t type);
+
+// Reads a swapped out page of the loaded address space back and maps it with `flags`
+bool swap_in(uint32_t virtual_page_index, pte_t entry, pte_t flags);
+
+// A slot is shared by the entries of forked processes, it's free when the last one goes
+void swap_slot_dup(uint32_t slot);
+void swap_slot_put(uint32_t slot);
+
+swap_stats_t swap_get_stats();
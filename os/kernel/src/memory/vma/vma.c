@@ -0,0 +1,369 @@
+#include "vma.h"
+#include "memory/paging/paging.h"
+#include "memory/swap/swap.h"
+#include "memory/slab/slab.h"
+#include "process/loader/elf_loader.h"
+#include "process/manager/process_manager.h"
+#include "drivers/vga/vga.h"
+#include "memory/heap/heap.h"
+
+// Error code bits pushed with a page fault
+#define PAGE_FAULT_PRESENT  0x1
+#define PAGE_FAULT_WRITE    0x2
+
+#define USER_PAGES (RELOCATION_OFFSET / PAGE_SIZE)
+
+static kmem_cache_t* vma_cache = NULL;
+static vma_stats_t vma_stats = {0};
+
+static void page_fault_handler(int_registers* regs)
+{
+    uintptr_t address;
+    asm volatile ("mov %%cr2, %0" : "=r"(address));
+    bool user_address = address < RELOCATION_OFFSET && get_current_process() != NULL;
+    bool write = regs->error & PAGE_FAULT_WRITE;
+
+    // Memory for the page this fault may need. It can swap out the faulting page too,
+    // so the entry is read after it instead of trusting the error code
+    if (user_address)
+        swap_balance();
+    bool present = user_address ? paging_get_entry(address / PAGE_SIZE) & PTE_PRESENT :
+        regs->error & PAGE_FAULT_PRESENT;
+
+    if (!present && vma_handle_fault(address, write))
+        return;
+    // A write to a page shared with a forked process
+    if (present && write && user_address && paging_handle_cow_fault(address / PAGE_SIZE))
+        return;
+
+    if (get_current_process() == NULL)
+        panic_screen("Page Fault");
+
+    // close the process that caused it
+    vga_printf("Segmentation fault");
+    exit_current_process();
+}
+
+void vma_init()
+{
+    vma_cache = kmem_cache_create("vma", sizeof(vma_t), NULL);
+    register_isr_handler(14, page_fault_handler);
+}
+
+vma_t* vma_add(vma_t** vmas, uint32_t first_page, uint32_t page_amount, uint32_t flags,
+    struct elf_image* image)
+{
+    if (page_amount == 0 || first_page + page_amount > USER_PAGES || first_page + page_amount < first_page)
+        return NULL;
+
+    vma_t** link = vmas;
+    while (*link != NULL && (*link)->first_page + (*link)->page_amount <= first_page)
+    {
+        link = &(*link)->next;
+    }
+    if (*link != NULL && (*link)->first_page < first_page + page_amount)
+        return NULL; // overlaps
+
+    vma_t* vma = kmem_cache_alloc(vma_cache);
+    if (vma == NULL)
+        return NULL;
+
+    vma->first_page = first_page;
+    vma->page_amount = page_amount;
+    vma->flags = flags;
+    vma->image = image;
+    if (image != NULL)
+        elf_image_get(image);
+    vma->file = NULL;
+    vma->file_offset = 0;
+    vma->next = *link;
+    *link = vma;
+    return vma;
+}
+
+vma_t* vma_find(vma_t* vmas, uint32_t virtual_page_index)
+{
+    for (vma_t* vma = vmas; vma != NULL && vma->first_page <= virtual_page_index; vma = vma->next)
+    {
+        if (virtual_page_index < vma->first_page + vma->page_amount)
+            return vma;
+    }
+    return NULL;
+}
+
+uint32_t vma_find_free(vma_t* vmas, uint32_t page_amount, uint32_t first_page, uint32_t end_page)
+{
+    uint32_t candidate = first_page;
+    for (vma_t* vma = vmas; vma != NULL && vma->first_page < candidate + page_amount; vma = vma->next)
+    {
+        if (vma->first_page + vma->page_amount > candidate)
+            candidate = vma->first_page + vma->page_amount;
+    }
+    if (candidate + page_amount > end_page || candidate + page_amount < candidate)
+        return 0;
+    return candidate;
+}
+
+static void put_backing(vma_t* vma)
+{
+    if (vma->image != NULL)
+        elf_image_put(vma->image);
+    if (vma->file != NULL)
+        vma_file_put(vma->file);
+}
+
+static void free_pages(uint32_t first_page, uint32_t page_amount, paging_flush_batch_t* batch)
+{
+    for (uint32_t i = 0; i < page_amount; i++)
+    {
+        deallocate_virtual_page(first_page + i);
+    }
+    paging_flush_batch_add(batch, first_page, page_amount);
+}
+
+bool vma_remove_range(vma_t** vmas, uint32_t first_page, uint32_t page_amount)
+{
+    uint32_t end_page = first_page + page_amount;
+    vma_t* middle = vma_find(*vmas, first_page);
+
+    // A hole in the middle of a VMA needs a new one for the part above it
+    vma_t* upper = NULL;
+    if (middle != NULL && middle->first_page < first_page && middle->first_page + middle->page_amount > end_page)
+    {
+        upper = kmem_cache_alloc(vma_cache);
+        if (upper == NULL)
+            return false;
+    }
+
+    paging_flush_batch_t batch;
+    paging_flush_batch_init(&batch);
+
+    vma_t** link = vmas;
+    while (*link != NULL && (*link)->first_page < end_page)
+    {
+        vma_t* vma = *link;
+        uint32_t vma_end = vma->first_page + vma->page_amount;
+        if (vma_end <= first_page)
+        {
+            link = &vma->next;
+            continue;
+        }
+
+        uint32_t cut_start = vma->first_page > first_page ? vma->first_page : first_page;
+        uint32_t cut_end = vma_end < end_page ? vma_end : end_page;
+        free_pages(cut_start, cut_end - cut_start, &batch);
+
+        if (vma == middle && upper != NULL)
+        {
+            *upper = *vma;
+            upper->first_page = cut_end;
+            upper->page_amount = vma_end - cut_end;
+            upper->file_offset += (cut_end - vma->first_page) * PAGE_SIZE;
+            if (upper->image != NULL)
+                elf_image_get(upper->image);
+            if (upper->file != NULL)
+                upper->file->ref_count++;
+            vma->page_amount = cut_start - vma->first_page;
+            vma->next = upper;
+            break;
+        }
+        if (cut_start > vma->first_page)
+        {
+            vma->page_amount = cut_start - vma->first_page; // keeps its lower part
+            link = &vma->next;
+        }
+        else if (cut_end < vma_end)
+        {
+            vma->file_offset += (cut_end - vma->first_page) * PAGE_SIZE; // keeps its upper part
+            vma->first_page = cut_end;
+            vma->page_amount = vma_end - cut_end;
+            link = &vma->next;
+        }
+        else
+        {
+            *link = vma->next;
+            put_backing(vma);
+            kmem_cache_free(vma_cache, vma);
+        }
+    }
+
+    paging_flush_batch_commit(&batch);
+    return true;
+}
+
+vma_file_t* vma_file_open(const FAT16_DirEntry* entry)
+{
+    vma_file_t* file = kmalloc(sizeof(vma_file_t));
+    if (file == NULL)
+        return NULL;
+    file->entry = *entry;
+    file->ref_count = 1;
+    return file;
+}
+
+void vma_file_put(vma_file_t* file)
+{
+    if (--file->ref_count == 0)
+        kfree(file);
+}
+
+bool vma_clone_all(vma_t* vmas, vma_t** clone)
+{
+    vma_t** link = clone;
+    *clone = NULL;
+
+    for (vma_t* vma = vmas; vma != NULL; vma = vma->next)
+    {
+        vma_t* copy = kmem_cache_alloc(vma_cache);
+        if (copy == NULL)
+        {
+            vma_free_all(clone);
+            return false;
+        }
+        *copy = *vma;
+        if (copy->image != NULL)
+            elf_image_get(copy->image);
+        if (copy->file != NULL)
+            copy->file->ref_count++;
+        copy->next = NULL;
+        *link = copy;
+        link = &copy->next;
+    }
+    return true;
+}
+
+void vma_free_all(vma_t** vmas)
+{
+    vma_t* vma = *vmas;
+    while (vma != NULL)
+    {
+        vma_t* next = vma->next;
+        put_backing(vma);
+        kmem_cache_free(vma_cache, vma);
+        vma = next;
+    }
+    *vmas = NULL;
+}
+
+static vma_t* grow_stack(process_t* process, uint32_t virtual_page_index)
+{
+    vma_t* below = NULL;
+    vma_t* stack = process->vmas;
+    while (stack != NULL && stack->first_page <= virtual_page_index)
+    {
+        below = stack;
+        stack = stack->next;
+    }
+    if (stack == NULL || !(stack->flags & VMA_GROWSDOWN))
+        return NULL;
+
+    if (stack->first_page + stack->page_amount - virtual_page_index > process->stack_limit)
+        return NULL;
+    if (below != NULL && below->first_page + below->page_amount + USER_STACK_GUARD_PAGES > virtual_page_index)
+        return NULL;
+
+    // The pages in between are only reserved, they're mapped when they're touched
+    stack->page_amount += stack->first_page - virtual_page_index;
+    stack->first_page = virtual_page_index;
+    vma_stats.stack_growths++;
+    return stack;
+}
+
+bool vma_handle_fault(uintptr_t address, bool write)
+{
+    return vma_handle_process_fault(get_current_process(), address, write);
+}
+
+bool vma_handle_process_fault(process_t* process, uintptr_t address, bool write)
+{
+    uint32_t virtual_page_index = address / PAGE_SIZE;
+    if (process == NULL || virtual_page_index >= USER_PAGES)
+        return false;
+
+    vma_t* vma = vma_find(process->vmas, virtual_page_index);
+    if (vma == NULL)
+        vma = grow_stack(process, virtual_page_index);
+    if (vma == NULL || (write && !(vma->flags & VMA_WRITE)))
+        return false;
+
+    pte_t flags = PTE_USER;
+    if (vma->flags & VMA_WRITE)
+        flags |= PTE_WRITABLE;
+    if (!(vma->flags & VMA_EXEC))
+        flags |= PTE_NX;
+
+    pte_t entry = paging_get_entry(virtual_page_index);
+    if (entry & PTE_SWAP)
+    {
+        if (!swap_in(virtual_page_index, entry, flags))
+            return false;
+        vma_stats.faults++;
+        return true;
+    }
+
+    // Read-only image pages are the same in every process of the image
+    if (vma->image != NULL && !(vma->flags & VMA_WRITE))
+    {
+        uint32_t page_index = elf_image_shared_page(vma->image, virtual_page_index);
+        if (page_index == 0)
+            return false;
+        if (!paging_map_page_flags(page_index, virtual_page_index, flags))
+        {
+            pmm_page_unref(page_index);
+            return false;
+        }
+        vma_stats.shared_pages++;
+        vma_stats.faults++;
+        return true;
+    }
+
+    uint32_t page_index = swap_allocate_page(PAGE_TYPE_USER_ANON);
+    if (page_index == 0)
+        return false;
+
+    // Filled before it's mapped, so the process never sees half a page
+    if (vma->image != NULL)
+    {
+        void* page = paging_kmap(KMAP_SLOT_FAULT, page_index);
+        bool filled = elf_image_fill_page(vma->image, virtual_page_index, page);
+        paging_kunmap(KMAP_SLOT_FAULT);
+        if (!filled)
+        {
+            pmm_deallocate_page(page_index);
+            return false;
+        }
+        vma_stats.image_pages++;
+    }
+    else if (vma->file != NULL)
+    {
+        // The part past the end of the file stays zeroed
+        void* page = paging_kmap(KMAP_SLOT_FAULT, page_index);
+        uint32_t offset = vma->file_offset + (virtual_page_index - vma->first_page) * PAGE_SIZE;
+        bool filled = fat_read(&vma->file->entry, offset, PAGE_SIZE, page) >= 0;
+        paging_kunmap(KMAP_SLOT_FAULT);
+        if (!filled)
+        {
+            pmm_deallocate_page(page_index);
+            return false;
+        }
+        vma_stats.file_pages++;
+    }
+    else
+    {
+        vma_stats.zero_pages++;
+    }
+
+    if (!paging_map_page_flags(page_index, virtual_page_index, flags))
+    {
+        pmm_deallocate_page(page_index);
+        return false;
+    }
+
+    vma_stats.faults++;
+    return true;
+}
+
+vma_stats_t vma_get_stats()
+{
+    return vma_stats;
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "filesystem/fat/fat.h"
+
+struct elf_image;
+struct process;
+
+#define VMA_WRITE   0x1
+#define VMA_EXEC    0x2
+#define VMA_GROWSDOWN 0x4   // a stack, faults under it grow it
+
+// A file mapped with mmap, shared by the VMAs that map it
+typedef struct {
+    FAT16_DirEntry entry;
+    uint32_t ref_count;
+} vma_file_t;
+
+// A range of a process's user half and where its pages come from. Nothing is mapped
+// up front, the page fault handler allocates a page on its first access and fills it
+// from the ELF image or the mapped file, or leaves it zeroed when there is neither (bss, stack).
+// Reclaim drops clean pages, the next fault fills them the same way again
+typedef struct vma {
+    uint32_t first_page;
+    uint32_t page_amount;
+    uint32_t flags;
+    struct elf_image* image;    // holds a reference, NULL for anonymous memory
+    vma_file_t* file;           // holds a reference, private mappings only
+    uint32_t file_offset;       // of first_page
+    struct vma* next;           // sorted by address
+} vma_t;
+
+typedef struct {
+    uint32_t faults;        // resolved ones
+    uint32_t image_pages;   // filled from an ELF image
+    uint32_t shared_pages;  // read-only image pages mapped from the image's copy
+    uint32_t file_pages;    // filled from an mmap'ed file
+    uint32_t zero_pages;
+    uint32_t stack_growths;
+} vma_stats_t;
+
+// Registers the page fault handler
+void vma_init();
+
+// Fails if the range overlaps a VMA of the list, returns the new VMA
+vma_t* vma_add(vma_t** vmas, uint32_t first_page, uint32_t page_amount, uint32_t flags,
+    struct elf_image* image);
+vma_t* vma_find(vma_t* vmas, uint32_t virtual_page_index);
+// The lowest free range of `page_amount` pages between the two pages, 0 if there is none
+uint32_t vma_find_free(vma_t* vmas, uint32_t page_amount, uint32_t first_page, uint32_t end_page);
+// Cuts a range out of the VMAs (splitting one if needed) and frees the pages mapped in it.
+// The address space of the VMAs has to be the loaded one
+bool vma_remove_range(vma_t** vmas, uint32_t first_page, uint32_t page_amount);
+
+vma_file_t* vma_file_open(const FAT16_DirEntry* entry);
+void vma_file_put(vma_file_t* file);
+// Copies a whole list for a forked process, all or nothing
+bool vma_clone_all(vma_t* vmas, vma_t** clone);
+// Frees the VMAs, not the pages mapped for them
+void vma_free_all(vma_t** vmas);
+
+// Maps the page of `address` in the current process, false if it's not in any of its VMAs
+// or the access isn't allowed there. A fault under a stack grows it if the stack stays
+// within the process's limit and a guard page is left above the VMA under it
+bool vma_handle_fault(uintptr_t address, bool write);
+// The same for a process that isn't running, its address space has to be the loaded one
+bool vma_handle_process_fault(struct process* process, uintptr_t address, bool write);
+
+vma_stats_t vma_get_stats();
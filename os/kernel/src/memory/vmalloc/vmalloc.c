@@ -0,0 +1,183 @@
+#include "vmalloc.h"
+#include "memory/heap/heap.h"
+
+// The free list is sorted by address so neighbours can always be merged
+static vm_area_t* free_areas = NULL;
+static vm_area_t* busy_areas = NULL;
+static vmalloc_stats_t vmalloc_stats;
+
+bool vmalloc_init()
+{
+    free_areas = kmalloc(sizeof(vm_area_t));
+    if (free_areas == NULL)
+    {
+        return false;
+    }
+    free_areas->first_page = VMALLOC_START / PAGE_SIZE;
+    free_areas->page_amount = (VMALLOC_END - VMALLOC_START) / PAGE_SIZE;
+    free_areas->next = NULL;
+    vmalloc_stats.free_pages = free_areas->page_amount;
+
+    paging_link_kernel_tables(VMALLOC_START / PAGE_SIZE, (VMALLOC_END - VMALLOC_START) / PAGE_SIZE);
+    return true;
+}
+
+// First fit, the area is cut from the front of a free one
+static vm_area_t* take_free_area(uint32_t page_amount)
+{
+    vm_area_t* area = kmalloc(sizeof(vm_area_t));
+    if (area == NULL)
+    {
+        return NULL;
+    }
+
+    vm_area_t** link = &free_areas;
+    for (vm_area_t* iter = free_areas; iter != NULL; link = &iter->next, iter = iter->next)
+    {
+        if (iter->page_amount < page_amount)
+        {
+            continue;
+        }
+
+        area->first_page = iter->first_page;
+        area->page_amount = page_amount;
+        iter->first_page += page_amount;
+        iter->page_amount -= page_amount;
+        if (iter->page_amount == 0)
+        {
+            *link = iter->next;
+            kfree(iter);
+        }
+        vmalloc_stats.free_pages -= page_amount;
+        return area;
+    }
+
+    kfree(area);
+    return NULL;
+}
+
+// Put an area back in address order, merging it with the free areas around it
+static void give_free_area(vm_area_t* area)
+{
+    vm_area_t* prev = NULL;
+    vm_area_t* next = free_areas;
+    while (next != NULL && next->first_page < area->first_page)
+    {
+        prev = next;
+        next = next->next;
+    }
+
+    vmalloc_stats.free_pages += area->page_amount;
+
+    if (next != NULL && area->first_page + area->page_amount == next->first_page)
+    {
+        area->page_amount += next->page_amount;
+        area->next = next->next;
+        kfree(next);
+    }
+    else
+    {
+        area->next = next;
+    }
+
+    if (prev != NULL && prev->first_page + prev->page_amount == area->first_page)
+    {
+        prev->page_amount += area->page_amount;
+        prev->next = area->next;
+        kfree(area);
+    }
+    else if (prev != NULL)
+    {
+        prev->next = area;
+    }
+    else
+    {
+        free_areas = area;
+    }
+}
+
+static void unmap_area(uint32_t first_page, uint32_t page_amount)
+{
+    paging_flush_batch_t batch;
+    paging_flush_batch_init(&batch);
+
+    for (uint32_t i = 0; i < page_amount; i++)
+    {
+        deallocate_virtual_page(first_page + i);
+    }
+    paging_flush_batch_add(&batch, first_page, page_amount);
+    paging_flush_batch_commit(&batch);
+}
+
+void* vmalloc(size_t size)
+{
+    if (size == 0 || size > VMALLOC_END - VMALLOC_START)
+    {
+        return NULL;
+    }
+    uint32_t page_amount = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    vm_area_t* area = take_free_area(page_amount + VMALLOC_GUARD_PAGES);
+    if (area == NULL)
+    {
+        return NULL;
+    }
+
+    uint32_t first_page = area->first_page + VMALLOC_GUARD_PAGES;
+    uint32_t pages[MAP_BATCH_SIZE];
+    for (uint32_t mapped = 0; mapped < page_amount; )
+    {
+        uint32_t batch = page_amount - mapped < MAP_BATCH_SIZE ? page_amount - mapped : MAP_BATCH_SIZE;
+        if (!pmm_allocate_pages(batch, pages, PAGE_TYPE_KERNEL))
+        {
+            unmap_area(first_page, mapped);
+            give_free_area(area);
+            return NULL;
+        }
+        // The page tables are linked at init, mapping can't fail
+        paging_map_range(first_page + mapped, pages, batch, PTE_WRITABLE);
+        mapped += batch;
+    }
+
+    // Newest first, the busy list is only searched by vfree
+    area->next = busy_areas;
+    busy_areas = area;
+    vmalloc_stats.mapped_pages += page_amount;
+    vmalloc_stats.areas++;
+    return (void*)(first_page * PAGE_SIZE);
+}
+
+void vfree(void* address)
+{
+    if (!is_vmalloc_address(address))
+    {
+        return;
+    }
+    uint32_t first_page = (uintptr_t)address / PAGE_SIZE - VMALLOC_GUARD_PAGES;
+
+    vm_area_t** link = &busy_areas;
+    for (vm_area_t* area = busy_areas; area != NULL; link = &area->next, area = area->next)
+    {
+        if (area->first_page != first_page)
+        {
+            continue;
+        }
+
+        *link = area->next;
+        unmap_area(first_page + VMALLOC_GUARD_PAGES, area->page_amount - VMALLOC_GUARD_PAGES);
+        vmalloc_stats.mapped_pages -= area->page_amount - VMALLOC_GUARD_PAGES;
+        vmalloc_stats.areas--;
+        give_free_area(area);
+        return;
+    }
+}
+
+inline bool is_vmalloc_address(const void* address)
+{
+    return (uintptr_t)address >= VMALLOC_START && (uintptr_t)address < VMALLOC_END;
+}
+
+vmalloc_stats_t vmalloc_get_stats()
+{
+    return vmalloc_stats;
+}
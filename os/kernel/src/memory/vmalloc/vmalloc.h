@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "memory/paging/paging.h"
+
+// Page granular kernel allocations, kept apart from the byte heap
+#define VMALLOC_START 0xE0000000
+#define VMALLOC_END KMAP_WINDOW_ADDR
+
+// Every allocation has an unmapped page below it, so running off either end of
+// an allocation (like a kernel stack overflowing) faults instead of corrupting a neighbour
+#define VMALLOC_GUARD_PAGES 1
+
+// A range of virtual pages, on the free list or the busy list
+typedef struct vm_area {
+    uint32_t first_page;  // virtual page index
+    uint32_t page_amount; // including the guard page
+    struct vm_area* next;
+} vm_area_t;
+
+typedef struct {
+    uint32_t mapped_pages;
+    uint32_t free_pages;    // of the virtual range
+    uint32_t areas;
+} vmalloc_stats_t;
+
+bool vmalloc_init();
+
+// Returns `size` bytes rounded up to pages, page aligned and not physically contiguous
+void* vmalloc(size_t size);
+void vfree(void* address);
+bool is_vmalloc_address(const void* address);
+
+vmalloc_stats_t vmalloc_get_stats();
@@ -1,81 +1,262 @@
 #include "elf_loader.h"
-#include "process/elf/elf_header.h"
 #include "process/elf/parser.h"
-#include "memory/physical/physical_memory_manager.h"
 #include "memory/heap/heap.h"
+#include "memory/scratch/scratch.h"
+#include "memory/swap/swap.h"
+#include <string.h>
 
-static bool allocate_multiple_pages(uint32_t starting_page_index, uint32_t page_count,
-    bool supervisor_permissions, uintptr_t page_tables_phys_addr)
+#define ELF_MAX_PROGRAM_HEADERS 32
+
+static elf_image_t* open_images = NULL;
+
+static bool same_file(const FAT16_DirEntry* a, const FAT16_DirEntry* b)
+{
+    return a->start_cluster == b->start_cluster && a->file_size == b->file_size;
+}
+
+// The page span of the segments and its (still empty) table of shared frames
+static bool init_shared_pages(elf_image_t* image)
 {
-    for (uint32_t i = 0; i < page_count; i++)
+    uint32_t first_page = 0xFFFFFFFF;
+    uint32_t end_page = 0;
+    for (uint32_t i = 0; i < image->segment_count; i++)
     {
-        uint32_t physical_page_index = pmm_allocate_page();
-        if (physical_page_index == 0)
+        const elf_Phdr* segment = &image->segments[i];
+        uint32_t segment_end = (segment->p_vaddr + segment->p_memsz + PAGE_SIZE - 1) / PAGE_SIZE;
+        if (segment->p_vaddr / PAGE_SIZE < first_page)
+            first_page = segment->p_vaddr / PAGE_SIZE;
+        if (segment_end > end_page)
+            end_page = segment_end;
+    }
+
+    image->first_page = first_page;
+    image->page_amount = end_page > first_page ? end_page - first_page : 0;
+    image->shared_pages = NULL;
+    if (image->page_amount == 0)
+        return true;
+
+    image->shared_pages = kmalloc(image->page_amount * sizeof(uint32_t));
+    if (image->shared_pages == NULL)
+        return false;
+    memset(image->shared_pages, 0, image->page_amount * sizeof(uint32_t));
+    return true;
+}
+
+elf_image_t* elf_image_open(const FAT16_DirEntry* file)
+{
+    for (elf_image_t* image = open_images; image != NULL; image = image->next)
+    {
+        if (same_file(&image->file, file))
         {
-            for (uint32_t j = 0; j < i; j++)
-            {
-                deallocate_virtual_page(starting_page_index + j);
-            }
-            return false;
+            elf_image_get(image);
+            return image;
         }
-        paging_map_page(physical_page_index, starting_page_index + i, supervisor_permissions,
-                page_tables_phys_addr);
     }
-    return true;
+
+    FAT16_DirEntry entry = *file;
+    elf_hdr header;
+
+    if (fat_read(&entry, 0, sizeof(elf_hdr), &header) != sizeof(elf_hdr) ||
+        !elf_is_valid_and_loadable((const uint8_t*)&header, sizeof(elf_hdr)) ||
+        header.e_phentsize != sizeof(elf_Phdr) || header.e_phnum > ELF_MAX_PROGRAM_HEADERS)
+    {
+        return NULL;
+    }
+
+    uint32_t headers_size = header.e_phnum * sizeof(elf_Phdr);
+    elf_Phdr* program_headers = scratch_alloc(headers_size);
+    elf_image_t* image = kmalloc(sizeof(elf_image_t));
+    if (program_headers == NULL || image == NULL ||
+        fat_read(&entry, header.e_phoff, headers_size, program_headers) != (int32_t)headers_size)
+    {
+        kfree(image);
+        scratch_free(program_headers);
+        return NULL;
+    }
+
+    image->file = entry;
+    image->entry = header.e_entry;
+    image->ref_count = 1;
+    image->segment_count = 0;
+    for (uint32_t i = 0; i < header.e_phnum; i++)
+    {
+        if (program_headers[i].p_type != elf_type_of_segment_load || program_headers[i].p_memsz == 0)
+            continue;
+        if (image->segment_count == ELF_IMAGE_MAX_SEGMENTS ||
+            program_headers[i].p_filesz > program_headers[i].p_memsz)
+        {
+            kfree(image);
+            image = NULL;
+            break;
+        }
+        image->segments[image->segment_count++] = program_headers[i];
+    }
+    scratch_free(program_headers);
+
+    if (image != NULL && !init_shared_pages(image))
+    {
+        kfree(image);
+        return NULL;
+    }
+    if (image != NULL)
+    {
+        image->next = open_images;
+        open_images = image;
+    }
+    return image;
 }
 
-uintptr_t elf_load_process(const uint8_t* elf_content, uint32_t elf_len,
-        page_directory_entry* process_page_dir)
+void elf_image_file_changed(const FAT16_DirEntry* file)
 {
-    elf_hdr* header = elf_get_header(elf_content);
-    size_t process_size = elf_get_size_in_mem(elf_content, elf_len);
-    
-    struct page_table_entry* process_page_tables = 
-        (page_table_entry*)kmalloc_pages(process_size / PAGE_SIZE / PAGES_PER_DIR + 1);
-    uintptr_t page_tables_phys_addr = get_physical_address(process_page_tables);
-
-    // allocate the virtual pages for the process
-    if (!allocate_multiple_pages(header->e_entry / PAGE_SIZE,
-        process_size / PAGE_SIZE + 2, false, page_tables_phys_addr)) 
+    elf_image_t** link = &open_images;
+    while (*link != NULL)
     {
-        kfree(process_page_tables);
-        return 0;
+        elf_image_t* image = *link;
+        if (image->file.start_cluster == file->start_cluster)
+        {
+            // The processes running it keep their reference, new ones read the file again
+            *link = image->next;
+            image->next = NULL;
+        }
+        else
+        {
+            link = &image->next;
+        }
     }
-    
-    // allocate the process's stack`
-    if (!allocate_multiple_pages(USER_STACK_TOP / PAGE_SIZE - DEFAULT_STACK_PAGE_AMOUNT, 
-        DEFAULT_STACK_PAGE_AMOUNT, false, page_tables_phys_addr))
+}
+
+void elf_image_get(elf_image_t* image)
+{
+    image->ref_count++;
+}
+
+void elf_image_put(elf_image_t* image)
+{
+    if (--image->ref_count != 0)
+        return;
+
+    // Not on the list anymore if its file changed
+    elf_image_t** link = &open_images;
+    while (*link != NULL && *link != image)
+    {
+        link = &(*link)->next;
+    }
+    if (*link != NULL)
+        *link = image->next;
+
+    // Processes that still map a shared frame hold their own references
+    for (uint32_t i = 0; i < image->page_amount; i++)
+    {
+        if (image->shared_pages[i] != 0)
+            pmm_page_unref(image->shared_pages[i]);
+    }
+    kfree(image->shared_pages);
+    kfree(image);
+}
+
+// A page can hold the end of one segment and the start of the next
+bool elf_image_fill_page(const elf_image_t* image, uint32_t virtual_page_index, void* page)
+{
+    uint32_t page_start = virtual_page_index * PAGE_SIZE;
+    uint32_t page_end = page_start + PAGE_SIZE;
+    FAT16_DirEntry entry = image->file;
+
+    for (uint32_t i = 0; i < image->segment_count; i++)
     {
-        // deallocate the process's previously allocated pages
-        for (uint32_t i = 0; i < process_size / PAGE_SIZE + 1; i++)
+        const elf_Phdr* segment = &image->segments[i];
+        uint32_t start = segment->p_vaddr > page_start ? segment->p_vaddr : page_start;
+        uint32_t end = segment->p_vaddr + segment->p_filesz < page_end ?
+            segment->p_vaddr + segment->p_filesz : page_end;
+        if (start >= end)
+            continue; // bss, or not in this page
+
+        uint32_t size = end - start;
+        if (fat_read(&entry, segment->p_offset + (start - segment->p_vaddr), size,
+            (uint8_t*)page + (start - page_start)) != (int32_t)size)
         {
-            deallocate_virtual_page(header->e_entry / PAGE_SIZE + i);
+            return false;
         }
-        kfree(process_page_tables);
-        return 0;
     }
+    return true;
+}
 
+uint32_t elf_image_shared_page(elf_image_t* image, uint32_t virtual_page_index)
+{
+    if (virtual_page_index < image->first_page || virtual_page_index - image->first_page >= image->page_amount)
+        return 0;
 
-    
-    for (uint32_t i = 0; i < header->e_shnum; i++)
+    uint32_t* shared = &image->shared_pages[virtual_page_index - image->first_page];
+    if (*shared == 0)
     {
-        elf_Shdr *section_header = elf_get_indexed_section_header(elf_content, elf_len, i);
-        if (section_header->size == 0 || !section_header->flags.occupies_memory_during_execution)
+        uint32_t page_index = swap_allocate_page(PAGE_TYPE_FILE_CACHE);
+        if (page_index == 0)
+            return 0;
+
+        void* page = paging_kmap(KMAP_SLOT_FAULT, page_index);
+        bool filled = elf_image_fill_page(image, virtual_page_index, page);
+        paging_kunmap(KMAP_SLOT_FAULT);
+        if (!filled)
         {
-            continue;
+            pmm_deallocate_page(page_index);
+            return 0;
         }
+        *shared = page_index; // the image's own reference
+    }
+
+    pmm_page_ref(*shared);
+    return *shared;
+}
+
+bool elf_load_process(elf_image_t* image, vma_t** vmas)
+{
+    vma_t* last = NULL;
+
+    for (uint32_t i = 0; i < image->segment_count; i++)
+    {
+        const elf_Phdr* segment = &image->segments[i];
+        uint32_t first_page = segment->p_vaddr / PAGE_SIZE;
+        uint32_t end_page = (segment->p_vaddr + segment->p_memsz + PAGE_SIZE - 1) / PAGE_SIZE;
+        uint32_t flags = (segment->p_flags.writable ? VMA_WRITE : 0) |
+            (segment->p_flags.executable ? VMA_EXEC : 0);
 
-        // memcpy the section to the newly mapped pages
-        if (section_header->type == elf_section_header_type_program_data)
+        // A page shared with the previous segment gets the permissions of both. It's split
+        // into its own VMA, so a writable segment doesn't make the read-only one before it private
+        if (last != NULL && first_page < last->first_page + last->page_amount)
         {
-            memcpy((void*)section_header->virtual_address, &elf_content[section_header->file_offset],
-                section_header->size);
+            uint32_t shared_page = last->first_page + last->page_amount - 1;
+            if (last->page_amount > 1 && (last->flags | flags) != last->flags)
+            {
+                last->page_amount--;
+                last = vma_add(vmas, shared_page, 1, last->flags | flags, image);
+                if (last == NULL)
+                {
+                    vma_free_all(vmas);
+                    return false;
+                }
+            }
+            else
+            {
+                last->flags |= flags;
+            }
+            first_page = shared_page + 1;
+            if (end_page <= first_page)
+                continue;
         }
-        else if (section_header->type == elf_section_header_type_bss)
+
+        last = vma_add(vmas, first_page, end_page - first_page, flags, image);
+        if (last == NULL)
         {
-            memset((void*)section_header->virtual_address, 0, section_header->size);
+            vma_free_all(vmas);
+            return false;
         }
     }
 
-    return process_size;
+    // The stack is never executable
+    if (vma_add(vmas, USER_STACK_TOP / PAGE_SIZE - USER_STACK_INITIAL_PAGES, USER_STACK_INITIAL_PAGES,
+        VMA_WRITE | VMA_GROWSDOWN, NULL) == NULL)
+    {
+        vma_free_all(vmas);
+        return false;
+    }
+    return true;
 }
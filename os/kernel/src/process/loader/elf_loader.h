@@ -1,9 +1,48 @@
 #pragma once
 
 #include "memory/paging/paging.h"
-#include "process/manager/process_manager.h"
+#include "memory/vma/vma.h"
+#include "filesystem/fat/fat.h"
+#include "process/elf/elf_header.h"
 
-#define DEFAULT_STACK_PAGE_AMOUNT 0x100
-#define USER_STACK_TOP (0xC0000000 - 0x1000)
+#define USER_SPACE_END 0xC0000000
+#define USER_STACK_TOP (USER_SPACE_END - 0x1000)
+// The stack VMA starts small and grows down on page faults, up to the process's stack limit.
+// The region it can grow into is kept free of mmap, with a guard page under it
+#define USER_STACK_INITIAL_PAGES 0x10
+#define USER_STACK_MAX_PAGES 0x800
+#define USER_STACK_GUARD_PAGES 1
+// mmap puts mappings without a fixed address here, under the stack
+#define USER_MMAP_BASE 0x40000000
+#define USER_MMAP_END (USER_STACK_TOP - (USER_STACK_MAX_PAGES + USER_STACK_GUARD_PAGES) * PAGE_SIZE)
+#define ELF_IMAGE_MAX_SEGMENTS 8
 
-uintptr_t elf_load_process(const uint8_t* elf_content, uint32_t elf_len, page_directory_entry* process_page_dir);
+// The loadable segments of an ELF file, its pages are read from the file when they're first touched.
+// Processes of the same file share one image, and the frames of its read-only pages
+typedef struct elf_image {
+    FAT16_DirEntry file;
+    uint32_t entry;
+    uint32_t ref_count;
+    uint32_t segment_count;
+    elf_Phdr segments[ELF_IMAGE_MAX_SEGMENTS];
+    uint32_t first_page;        // of the lowest segment
+    uint32_t page_amount;       // up to the end of the highest segment
+    uint32_t* shared_pages;     // frame of each read-only page, 0 until it's first touched
+    struct elf_image* next;     // open images
+} elf_image_t;
+
+// Reads the headers, NULL if the file isn't a loadable ELF. A file that is already open
+// (same start cluster and size) gives its image another reference instead
+elf_image_t* elf_image_open(const FAT16_DirEntry* file);
+// The FAT change callback, a written or deleted file's image is no longer given to new opens
+void elf_image_file_changed(const FAT16_DirEntry* file);
+void elf_image_get(elf_image_t* image);
+void elf_image_put(elf_image_t* image);
+// Copies the file's bytes of a page to `page`, which is already zeroed
+bool elf_image_fill_page(const elf_image_t* image, uint32_t virtual_page_index, void* page);
+// The frame holding a read-only page of the image, read on the first call. The caller gets
+// a reference to it, 0 on failure. Uses KMAP_SLOT_FAULT
+uint32_t elf_image_shared_page(elf_image_t* image, uint32_t virtual_page_index);
+
+// Adds the VMAs of the image's segments and of the stack, nothing is mapped yet
+bool elf_load_process(elf_image_t* image, vma_t** vmas);
@@ -1,5 +1,7 @@
 #include "process_manager.h"
 #include "memory/heap/heap.h"
+#include "memory/slab/slab.h"
+#include "memory/vmalloc/vmalloc.h"
 #include "process/loader/elf_loader.h"
 #include "process/elf/parser.h"
 #include "cpu/gdt/gdt.h"
@@ -10,14 +12,19 @@
 extern void jump_usermode(process_registers_t *addr);
 extern void jump_kernelmode(process_registers_t *addr);
 
-#define HIGHER_HALF_START 0xC0000000
-
 static process_node_t* process_list_head = NULL;
 static process_node_t* process_list_tail = NULL;
 static uint32_t next_pid = 1;
-static process_node_t* current_process_g = NULL;
+static process_node_t* current_process_g = NULL; // NULL while the idle loop runs
+static scheduler_t scheduler;
+static kmem_cache_t* process_node_cache = NULL;
+// The kernel stack of a process that exited on it, freed once another stack is in use
+static void* dead_kernel_stack = NULL;
 static bool run_processes = false;
 
+// The context of kmain's idle loop, it runs whenever no process is ready
+static process_t idle_process = {0};
+
 static bool manage_initialized = false;
 
 void add_to_linked_list(process_node_t* new_process_node)
@@ -47,6 +54,13 @@ void proc_manager_init()
     get_glob_fd()[1].is_used = true;
     get_glob_fd()[2].is_used = true;
 
+    idle_process.is_kernel_mode = true;
+    idle_process.page_directory = get_kernel_pd();
+    idle_process.state = PROCESS_READY;
+    sched_init_default(&scheduler);
+
+    process_node_cache = kmem_cache_create("process_node", sizeof(process_node_t), NULL);
+
     manage_initialized= true;
 
     // register force_context_switch interrupt
@@ -62,6 +76,38 @@ void init_proc_fd(file_descriptor *fd_table, size_t size)
     fd_table[2].is_used = true;
 }
 
+// A preempted process keeps its level
+static void make_ready(process_node_t* node)
+{
+    node->proc.state = PROCESS_READY;
+    sched_make_ready(&scheduler, &node->sched);
+}
+
+// New and woken processes get the wakeup boost
+static void wake(process_node_t* node)
+{
+    node->proc.state = PROCESS_READY;
+    sched_wake(&scheduler, &node->sched);
+}
+
+static process_node_t* pick_next()
+{
+    sched_entity_t* entity = sched_pick(&scheduler);
+    return entity ? entity->owner : NULL;
+}
+
+static process_node_t* find_process_node(uint32_t pid)
+{
+    if (pid == 0)
+        return current_process_g;
+    for (process_node_t* iter = process_list_head; iter != NULL; iter = iter->next)
+    {
+        if (iter->proc.pid == pid)
+            return iter;
+    }
+    return NULL;
+}
+
 static int remove_from_linked_list(process_node_t* proc_node)
 {
     if (!proc_node) return -1; // Handle NULL input
@@ -97,95 +143,71 @@ int create_process(const char *path, int flags)
         return r;
     }
     kmalloc(1); // TODO: find out why it crashes
-    int elf_len = data.file_entry.file_size;
-    uint8_t* elf_content = kmalloc(elf_len);
-    memset(elf_content, 0, data.file_entry.file_size);
 
-    fat_read(&data.file_entry, 0, data.file_entry.file_size, elf_content);
-    
-    if (elf_is_valid_and_loadable(elf_content, elf_len))
-    {
-        if (!create_process_from_elf(elf_content, elf_len, flags))
-        {
-            kfree(elf_content);
-            return -1;
-        }
-    }
-    else
+    // Only the headers are read, the rest of the file is paged in by the page fault handler
+    elf_image_t* image = elf_image_open(&data.file_entry);
+    if (image == NULL)
     {
-        kfree(elf_content);
         return -1; // TODO: Try load binary
     }
 
-    kfree(elf_content);
-    return 0;
+    process_t* process = create_process_from_image(image, flags);
+    elf_image_put(image);
+    return process ? (int)process->pid : -1;
 }
 
-bool create_process_from_elf(const uint8_t* elf_content, uint32_t elf_len, int flags)
+process_t* create_process_from_image(elf_image_t* image, int flags)
 {
     if (!manage_initialized)
-        return false;
-
-    if (!elf_is_valid_and_loadable(elf_content, elf_len))
-    {
-        return false;
-    }
-
-    struct page_directory_entry* prev_pd = get_current_pd();
-    struct page_directory_entry* kernel_pd = get_kernel_pd();
+        return NULL;
 
-    load_pd(kernel_pd);
-
-    process_node_t* new_process_node = kmalloc(sizeof(process_node_t));
+    process_node_t* new_process_node = kmem_cache_alloc(process_node_cache);
     if (new_process_node == NULL) 
     {
-        return false;
+        return NULL;
     }
 
     memset(new_process_node->proc.cwd, 0, 256);
     strcpy(new_process_node->proc.cwd, "/");
 
-    elf_hdr* elf_header = elf_get_header(elf_content);
-
     new_process_node->proc.pid = next_pid++;
     new_process_node->proc.state = PROCESS_READY;
     new_process_node->proc.regs = (process_registers_t){0};
+    new_process_node->proc.scratch = (scratch_arena_t){0};
+    new_process_node->proc.vmas = NULL;
+    new_process_node->proc.stack_limit = USER_STACK_MAX_PAGES;
     
-    new_process_node->proc.kernel_stack = kmalloc_pages(PROC_KERNEL_STACK_SIZE) + PAGE_SIZE * PROC_KERNEL_STACK_SIZE;
-    new_process_node->proc.page_directory = (struct page_directory_entry*)kmalloc_pages(1);
-    if (new_process_node->proc.page_directory == NULL)
+    // vmalloc puts a guard page under the stack
+    void* kernel_stack = vmalloc(PAGE_SIZE * PROC_KERNEL_STACK_SIZE);
+    if (kernel_stack == NULL)
     {
-        kfree(new_process_node);
-        return false;
+        kmem_cache_free(process_node_cache, new_process_node);
+        return NULL;
+    }
+    new_process_node->proc.kernel_stack = kernel_stack + PAGE_SIZE * PROC_KERNEL_STACK_SIZE;
+    // Shares the kernel's half, the user half's page tables are allocated when pages are mapped
+    new_process_node->proc.page_directory = paging_create_address_space();
+    if (new_process_node->proc.page_directory == 0)
+    {
+        vfree(kernel_stack);
+        kmem_cache_free(process_node_cache, new_process_node);
+        return NULL;
     }
 
-    // Copy the kernel page directory entries
-    // [0x300] - [0x400] entries are for the kernel
-    memcpy(&new_process_node->proc.page_directory[HIGHER_HALF_START / PAGE_SIZE / PAGES_PER_DIR],
-        &kernel_pd[HIGHER_HALF_START / PAGE_SIZE / PAGES_PER_DIR], 
-        sizeof(struct page_directory_entry) * (PAGES_PER_DIR - (HIGHER_HALF_START / PAGE_SIZE / PAGES_PER_DIR)));
-    
-    // Implement recursive mapping (map the last entry to the page directory itself)
-    new_process_node->proc.page_directory[PAGES_PER_DIR - 1].table_entry_address 
-        = (get_physical_address(new_process_node->proc.page_directory) >> 12);
-
-    load_pd(new_process_node->proc.page_directory);
-
-    // Load process to memory
-    uint32_t process_size = elf_load_process(elf_content, elf_len, new_process_node->proc.page_directory);
-    load_pd(kernel_pd);
-
-    if (process_size == 0)
+    // Nothing is mapped yet, the pages come in on their first page fault
+    if (!elf_load_process(image, &new_process_node->proc.vmas))
     {
-        kfree(new_process_node->proc.page_directory);
-        kfree(new_process_node);
-        return false;
+        paging_free_address_space(new_process_node->proc.page_directory);
+        vfree(kernel_stack);
+        kmem_cache_free(process_node_cache, new_process_node);
+        return NULL;
     }
 
+    memset(new_process_node->proc.fd_table, 0, sizeof(new_process_node->proc.fd_table));
     init_proc_fd(new_process_node->proc.fd_table, MAX_LOCAL_FD);
     attach_process_to_terminal(get_active_terminal_id(), &new_process_node->proc);
     
-    new_process_node->proc.regs.eip = elf_header->e_entry;
+    new_process_node->proc.regs.eip = image->entry;
     new_process_node->proc.regs.esp = USER_STACK_TOP - 4;
     
     new_process_node->proc.regs.cs = 0x1B;
@@ -194,22 +216,114 @@ bool create_process_from_elf(const uint8_t* elf_content, uint32_t elf_len, int f
     new_process_node->proc.is_kernel_mode = false;
     
     add_to_linked_list(new_process_node);
+    sched_entity_init(&new_process_node->sched, new_process_node, 0);
+    wake(new_process_node);
+
+    return &new_process_node->proc;
+}
+
+int fork_current_process(const struct int_registers* regs)
+{
+    process_t* parent = get_current_process();
+    if (parent == NULL)
+        return -ESRCH;
+
+    process_node_t* child_node = kmem_cache_alloc(process_node_cache);
+    if (child_node == NULL)
+        return -ENOMEM;
+    process_t* child = &child_node->proc;
+
+    void* kernel_stack = vmalloc(PAGE_SIZE * PROC_KERNEL_STACK_SIZE);
+    if (kernel_stack == NULL)
+    {
+        kmem_cache_free(process_node_cache, child_node);
+        return -ENOMEM;
+    }
+    if (!vma_clone_all(parent->vmas, &child->vmas))
+    {
+        vfree(kernel_stack);
+        kmem_cache_free(process_node_cache, child_node);
+        return -ENOMEM;
+    }
+    // Only the page tables are copied, the frames are shared until one side writes
+    child->page_directory = paging_clone_address_space();
+    if (child->page_directory == 0)
+    {
+        vma_free_all(&child->vmas);
+        vfree(kernel_stack);
+        kmem_cache_free(process_node_cache, child_node);
+        return -ENOMEM;
+    }
+
+    child->pid = next_pid++;
+    child->terminal_id = parent->terminal_id;
+    child->is_kernel_mode = false;
+    memcpy(child->cwd, parent->cwd, sizeof(child->cwd));
+    child->kernel_stack = kernel_stack + PAGE_SIZE * PROC_KERNEL_STACK_SIZE;
+    child->state = PROCESS_READY;
+    child->scratch = (scratch_arena_t){0};
+    child->stack_limit = parent->stack_limit;
+
+    // Both processes hold the open files now. The terminal's devices aren't counted,
+    // release_proc_fds leaves them open
+    memcpy(child->fd_table, parent->fd_table, sizeof(child->fd_table));
+    for (uint32_t i = 0; i < MAX_LOCAL_FD; i++)
+    {
+        global_file_descriptor* global_fd = child->fd_table[i].global_fd;
+        if (child->fd_table[i].is_used && global_fd != NULL && !global_fd->is_device)
+            global_fd->ref_count++;
+    }
 
-    load_pd(prev_pd);
+    // The child returns from the same syscall with 0
+    copy_registers(regs, &child->regs);
+    child->regs.eax = 0;
 
-    return true;
+    add_to_linked_list(child_node);
+    sched_entity_init(&child_node->sched, child_node, current_process_g->sched.nice);
+    wake(child_node);
+    return child->pid;
+}
+
+// Like closing every open file, the terminal's devices stay open
+static void release_proc_fds(process_t* process)
+{
+    for (uint32_t i = 0; i < MAX_LOCAL_FD; i++)
+    {
+        global_file_descriptor* global_fd = process->fd_table[i].global_fd;
+        if (!process->fd_table[i].is_used || global_fd == NULL || global_fd->is_device)
+            continue;
+
+        if (--global_fd->ref_count == 0)
+            memset(global_fd, 0, sizeof(global_file_descriptor));
+    }
+    memset(process->fd_table, 0, sizeof(process->fd_table));
 }
 
 static void free_proc_node(process_t* process)
 {
-    kfree(process->page_directory); // TODO: Free page tables
-    kfree(process);
+    void* kernel_stack = process->kernel_stack - PAGE_SIZE * PROC_KERNEL_STACK_SIZE;
+
+    // This runs on the kernel stack of the current process when it exits
+    vfree(dead_kernel_stack);
+    dead_kernel_stack = NULL;
+    if (current_process_g && process == &current_process_g->proc)
+        dead_kernel_stack = kernel_stack;
+    else
+        vfree(kernel_stack);
+
+    release_proc_fds(process);
+    scratch_arena_destroy(&process->scratch);
+    vma_free_all(&process->vmas);
+    // The user pages and page tables go with it
+    paging_free_address_space(process->page_directory);
+    kmem_cache_free(process_node_cache, process);
 }
 
 static void jump_proc_wrapper(process_t* proc)
 {
     load_pd(proc->page_directory);
-    tss_fill_esp0((uint32_t)proc->kernel_stack);
+    if (proc->kernel_stack) // the idle loop never leaves ring 0
+        tss_fill_esp0((uint32_t)proc->kernel_stack);
 
     if (proc->is_kernel_mode)
         jump_kernelmode(&proc->regs);
@@ -218,31 +332,42 @@ static void jump_proc_wrapper(process_t* proc)
 }
 
 
-int exit_proc(process_node_t* exiting_proc)
+static void run_next_process(process_node_t* next)
 {
-    if (!exiting_proc) return -EINVAL; // Validate input
-
-    // Check if there are any processes left
-    if (!process_list_head) {
-        panic_screen("No process running, Reboot PC1!!!");
+    current_process_g = next;
+    if (current_process_g == NULL)
+    {
+        jump_proc_wrapper(&idle_process);
     }
 
-    // Switch to the next process in the list
-    if (current_process_g->next) {
-        current_process_g = current_process_g->next;
-    } else {
-        current_process_g = process_list_head;
-    }
+    current_process_g->proc.state = PROCESS_RUNNING;
+    jump_proc_wrapper(&current_process_g->proc);
+}
 
-    if (!current_process_g) {
-        panic_screen("No process running, Reboot PC2!!!");
-    }
+int exit_proc(process_node_t* exiting_proc)
+{
+    if (!exiting_proc) return -EINVAL; // Validate input
 
     load_pd(get_kernel_pd());
+    sched_remove(&scheduler, &exiting_proc->sched);
     remove_from_linked_list(exiting_proc);
     free_proc_node(&exiting_proc->proc);
 
-    jump_proc_wrapper(&current_process_g->proc);
+    run_next_process(pick_next());
+}
+
+int destroy_process(uint32_t pid)
+{
+    process_node_t* node = pid != 0 ? find_process_node(pid) : NULL;
+    if (node == NULL)
+        return -ESRCH;
+    if (node == current_process_g)
+        return -EBUSY;
+
+    sched_remove(&scheduler, &node->sched);
+    remove_from_linked_list(node);
+    free_proc_node(&node->proc);
+    return 0;
 }
 
 void exit_current_process()
@@ -251,6 +376,17 @@ void exit_current_process()
     exit_proc(exiting_proc);
 }
 
+process_t* get_next_process(uint32_t pid)
+{
+    // The list is in creation order, so it's sorted by pid
+    for (process_node_t* iter = process_list_head; iter != NULL; iter = iter->next)
+    {
+        if (iter->proc.pid > pid)
+            return &iter->proc;
+    }
+    return NULL;
+}
+
 inline process_t* get_current_process()
 {
     if (current_process_g)
@@ -263,25 +399,47 @@ inline void force_switch_process()
     asm("int $0x69");
 }
 
-void wake_up_terminal_processes(uint32_t terminal_id)
+void block_current_process(process_queue_t* queue)
+{
+    if (current_process_g == NULL)
+        return;
+
+    current_process_g->proc.state = PROCESS_BLOCKED;
+    sched_queue_push(queue, &current_process_g->sched);
+    force_switch_process();
+}
+
+void wake_up_all(process_queue_t* queue)
+{
+    sched_entity_t* entity;
+    while ((entity = sched_queue_pop(queue)) != NULL)
+    {
+        wake(entity->owner);
+    }
+}
+
+void scheduler_tick(struct int_registers* regs)
+{
+    if (sched_tick(&scheduler, current_process_g ? &current_process_g->sched : NULL))
+        switch_process(regs);
+}
+
+int get_process_nice(uint32_t pid, int* nice)
+{
+    process_node_t* node = find_process_node(pid);
+    if (node == NULL)
+        return -ESRCH;
+    *nice = node->sched.nice;
+    return 0;
+}
+
+int set_process_nice(uint32_t pid, int nice)
 {
-    process_node_t* iter = current_process_g;
-
-    do {
-        if (iter->proc.state == PROCESS_BLOCKED)
-        {
-            if (iter->proc.terminal_id == terminal_id)
-                iter->proc.state = PROCESS_READY;
-        }
-        if (iter->next != NULL)
-        {
-            iter = iter->next;
-        }
-        else
-        {
-            iter = process_list_head;
-        }
-    } while(iter != current_process_g);
+    process_node_t* node = find_process_node(pid);
+    if (node == NULL)
+        return -ESRCH;
+    sched_set_nice(&scheduler, &node->sched, nice);
+    return 0;
 }
 
 void switch_process(struct int_registers* regs)
@@ -291,32 +449,20 @@ void switch_process(struct int_registers* regs)
 
     if (current_process_g == NULL)
     {
-        current_process_g = process_list_head;
-        if (current_process_g->proc.state == PROCESS_READY)
-            goto switch_label;
+        // The idle loop was interrupted
+        copy_registers(regs, &idle_process.regs);
     }
     else
     {
-        if (current_process_g->proc.state == PROCESS_RUNNING) // only if process was running, set it as ready (if its blocked then dont run ofc)
-            current_process_g->proc.state = PROCESS_READY;
+        // A blocked process is already on its wait queue
+        if (current_process_g->proc.state == PROCESS_RUNNING)
+            make_ready(current_process_g);
 
         copy_registers(regs, &current_process_g->proc.regs);
-        do
-        {
-            if (current_process_g->next != NULL)
-            {
-                current_process_g = current_process_g->next;
-            }
-            else
-            {
-                current_process_g = process_list_head;
-            }
-        } while (current_process_g->proc.state != PROCESS_READY);
     }
 
-switch_label:
-    current_process_g->proc.state = PROCESS_RUNNING;
-    jump_proc_wrapper(&current_process_g->proc);
+    // With nothing ready go back to idle instead of spinning here with interrupts disabled
+    run_next_process(pick_next());
 }
 
 
@@ -334,6 +480,13 @@ void copy_registers(const struct int_registers *src, process_registers_t *dst) {
     dst->eflags = src->eflags;
     dst->esp = src->esp;
     dst->ss = src->ss;
+
+    // No privilege change, the cpu didn't push esp and ss
+    if ((src->cs & 3) == 0)
+    {
+        dst->esp = src->kern_esp + 5 * sizeof(uint32_t); // above interrupt, error, eip, cs, eflags
+        dst->ss = 0x10;
+    }
 }
 
 void enable_processes()
@@ -3,6 +3,11 @@
 #include "memory/paging/paging.h"
 #include "filesystem/fat/fat.h"
 #include "cpu/idt/isr.h"
+#include "memory/scratch/scratch.h"
+#include "memory/vma/vma.h"
+#include "process/scheduler/scheduler.h"
+
+struct elf_image;
 
 #define MAX_GLOB_FD 256
 #define MAX_LOCAL_FD 128
@@ -36,36 +41,56 @@ typedef struct {
    uint32_t eip, cs, eflags, esp, ss;
 } process_registers_t;
 
-typedef struct {
+typedef struct process {
     uint32_t pid;
     uint32_t terminal_id;
     bool is_kernel_mode;
     char cwd[256];
-    struct page_directory_entry* page_directory;
+    uintptr_t page_directory; // physical, what gets loaded to cr3
     void* kernel_stack;
     process_state_t state;
     file_descriptor fd_table[MAX_LOCAL_FD];
     process_registers_t regs;
+    scratch_arena_t scratch;
+    vma_t* vmas;
+    uint32_t stack_limit;   // pages the stack can grow to, RLIMIT_STACK
 } process_t;
 
 typedef struct process_node_t {
     process_t proc;
-    struct process_node_t* next;
+    struct process_node_t* next;    // all the processes, by pid
     struct process_node_t* prev;
+    sched_entity_t sched;
 } process_node_t;
 
 void proc_manager_init();
 void init_proc_fd(file_descriptor *fd_table, size_t size);
 
+// Returns the new process's pid
 int create_process(const char *path, int flags);
-bool create_process_from_elf(const uint8_t* elf_content, uint32_t elf_len, int flags);
+process_t* create_process_from_image(struct elf_image* image, int flags);
+// Copy of the current process that shares its memory copy-on-write, `regs` are the ones
+// it made the syscall with. Returns the child's pid, or a negative errno
+int fork_current_process(const struct int_registers* regs);
 
 int exit_proc(process_node_t* exiting_proc);
+// Frees a process that isn't the running one, with its whole address space
+int destroy_process(uint32_t pid);
 void exit_current_process();
 process_t* get_current_process();
+// The process with the lowest pid above `pid`, for walking all of them. NULL after the last one
+process_t* get_next_process(uint32_t pid);
 
 void force_switch_process();
-void wake_up_terminal_processes(uint32_t terminal_id);
+// Puts the current process on `queue` and runs another one, returns once it's woken
+void block_current_process(process_queue_t* queue);
+// Moves every process of `queue` to the ready queue, with the wakeup boost
+void wake_up_all(process_queue_t* queue);
+// Called by the timer interrupt on every tick
+void scheduler_tick(struct int_registers* regs);
+// `pid` 0 is the current process. Return 0 or -ESRCH
+int get_process_nice(uint32_t pid, int* nice);
+int set_process_nice(uint32_t pid, int nice);
 
 void switch_process(struct int_registers* regs);
 void copy_registers(const struct int_registers *src, process_registers_t *dst);
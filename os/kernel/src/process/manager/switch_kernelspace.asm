@@ -1,14 +1,27 @@
 global jump_kernelmode
 jump_kernelmode:
-    ; set the segments to be ring 4
-    mov esp, eax
-
     mov ax, 0x10
     mov ds, ax
     mov es, ax 
     mov fs, ax 
     mov gs, ax
 
-    ; pop all registers
+    mov eax, [esp + 4] ; the saved registers
+
+    ; ring 0 iret doesn't pop esp, so build the eip, cs, eflags frame
+    ; on the stack we return to and keep its address in the unused slot
+    mov ecx, [eax + 44] ; esp
+    sub ecx, 12
+    mov edx, [eax + 32] ; eip
+    mov [ecx], edx
+    mov edx, [eax + 36] ; cs
+    mov [ecx + 4], edx
+    mov edx, [eax + 40] ; eflags
+    mov [ecx + 8], edx
+    mov [eax + 12], ecx
+
+    ; pop all registers (popad skips the unused slot)
+    mov esp, eax
     popad
-    iret ; pop eip, cs, flags, esp, ss and jump to the usermode code
\ No newline at end of file
+    mov esp, [esp - 20]
+    iret ; pop eip, cs, flags and continue where the process stopped
\ No newline at end of file
@@ -0,0 +1,205 @@
+#include "scheduler.h"
+#include <stddef.h>
+
+static const uint32_t default_quanta[SCHED_LEVELS] = SCHED_QUANTA_TICKS;
+
+void sched_init(scheduler_t* scheduler, const uint32_t* quanta, uint32_t level_count, uint32_t boost_interval)
+{
+    if (level_count > SCHED_LEVELS)
+        level_count = SCHED_LEVELS;
+    if (level_count == 0)
+        level_count = 1;
+
+    for (uint32_t i = 0; i < SCHED_LEVELS; i++)
+    {
+        scheduler->levels[i] = (process_queue_t){0};
+        scheduler->quanta[i] = i < level_count && quanta[i] > 0 ? quanta[i] : 1;
+    }
+    scheduler->level_count = level_count;
+    scheduler->ready_count = 0;
+    scheduler->boost_interval = boost_interval;
+    scheduler->ticks_to_boost = boost_interval;
+}
+
+void sched_init_default(scheduler_t* scheduler)
+{
+    sched_init(scheduler, default_quanta, SCHED_LEVELS, SCHED_BOOST_INTERVAL_TICKS);
+}
+
+void sched_entity_init(sched_entity_t* entity, void* owner, int nice)
+{
+    entity->next = NULL;
+    entity->prev = NULL;
+    entity->queue = NULL;
+    entity->owner = owner;
+    entity->nice = nice < NICE_MIN ? NICE_MIN : nice > NICE_MAX ? NICE_MAX : nice;
+    entity->level = 0; // set by sched_wake
+    entity->ticks_left = 0;
+}
+
+void sched_queue_push(process_queue_t* queue, sched_entity_t* entity)
+{
+    entity->queue = queue;
+    entity->next = NULL;
+    entity->prev = queue->tail;
+    if (queue->tail)
+        queue->tail->next = entity;
+    else
+        queue->head = entity;
+    queue->tail = entity;
+}
+
+void sched_queue_remove(sched_entity_t* entity)
+{
+    process_queue_t* queue = entity->queue;
+    if (queue == NULL)
+        return;
+
+    if (entity->prev)
+        entity->prev->next = entity->next;
+    else
+        queue->head = entity->next;
+    if (entity->next)
+        entity->next->prev = entity->prev;
+    else
+        queue->tail = entity->prev;
+    entity->queue = NULL;
+}
+
+sched_entity_t* sched_queue_pop(process_queue_t* queue)
+{
+    sched_entity_t* entity = queue->head;
+    if (entity)
+        sched_queue_remove(entity);
+    return entity;
+}
+
+static uint32_t top_level(const scheduler_t* scheduler, int nice)
+{
+    uint32_t nice_levels = scheduler->level_count < SCHED_NICE_LEVELS ? scheduler->level_count : SCHED_NICE_LEVELS;
+    return (nice - NICE_MIN) * nice_levels / (NICE_MAX - NICE_MIN + 1);
+}
+
+static bool is_ready(const scheduler_t* scheduler, const sched_entity_t* entity)
+{
+    return entity->queue >= &scheduler->levels[0] && entity->queue < &scheduler->levels[SCHED_LEVELS];
+}
+
+static void take_ready(scheduler_t* scheduler, sched_entity_t* entity)
+{
+    sched_queue_remove(entity);
+    scheduler->ready_count--;
+}
+
+void sched_remove(scheduler_t* scheduler, sched_entity_t* entity)
+{
+    if (is_ready(scheduler, entity))
+        take_ready(scheduler, entity);
+    else
+        sched_queue_remove(entity);
+}
+
+void sched_make_ready(scheduler_t* scheduler, sched_entity_t* entity)
+{
+    if (entity->level >= scheduler->level_count)
+        entity->level = scheduler->level_count - 1;
+    sched_queue_push(&scheduler->levels[entity->level], entity);
+    scheduler->ready_count++;
+}
+
+void sched_wake(scheduler_t* scheduler, sched_entity_t* entity)
+{
+    uint32_t top = top_level(scheduler, entity->nice);
+    entity->level = top > SCHED_WAKE_BOOST ? top - SCHED_WAKE_BOOST : 0;
+    sched_make_ready(scheduler, entity);
+}
+
+// The highest level with a ready process, level_count if there is none
+static uint32_t first_ready_level(const scheduler_t* scheduler)
+{
+    uint32_t level = 0;
+    while (level < scheduler->level_count && scheduler->levels[level].head == NULL)
+    {
+        level++;
+    }
+    return level;
+}
+
+sched_entity_t* sched_pick(scheduler_t* scheduler)
+{
+    uint32_t level = first_ready_level(scheduler);
+    if (level == scheduler->level_count)
+        return NULL;
+
+    sched_entity_t* entity = scheduler->levels[level].head;
+    take_ready(scheduler, entity);
+    entity->ticks_left = scheduler->quanta[level];
+    return entity;
+}
+
+// Every ready process goes back to its top level, the running one too
+static void boost(scheduler_t* scheduler, sched_entity_t* running)
+{
+    for (uint32_t level = 1; level < scheduler->level_count; level++)
+    {
+        sched_entity_t* entity = scheduler->levels[level].head;
+        while (entity != NULL)
+        {
+            sched_entity_t* next = entity->next;
+            uint32_t top = top_level(scheduler, entity->nice);
+            if (top < level)
+            {
+                take_ready(scheduler, entity);
+                entity->level = top;
+                sched_make_ready(scheduler, entity);
+            }
+            entity = next;
+        }
+    }
+    if (running != NULL)
+        running->level = top_level(scheduler, running->nice);
+}
+
+bool sched_tick(scheduler_t* scheduler, sched_entity_t* running)
+{
+    if (scheduler->boost_interval != 0 && --scheduler->ticks_to_boost == 0)
+    {
+        scheduler->ticks_to_boost = scheduler->boost_interval;
+        boost(scheduler, running);
+    }
+
+    if (running == NULL)
+        return scheduler->ready_count > 0;
+
+    if (running->ticks_left > 0)
+        running->ticks_left--;
+    if (running->ticks_left == 0)
+    {
+        if (running->level + 1 < scheduler->level_count)
+            running->level++;
+        if (scheduler->ready_count > 0)
+            return true;
+        running->ticks_left = scheduler->quanta[running->level]; // nothing else wants the cpu
+        return false;
+    }
+    return first_ready_level(scheduler) < running->level;
+}
+
+void sched_set_nice(scheduler_t* scheduler, sched_entity_t* entity, int nice)
+{
+    entity->nice = nice < NICE_MIN ? NICE_MIN : nice > NICE_MAX ? NICE_MAX : nice;
+
+    uint32_t top = top_level(scheduler, entity->nice);
+    if (entity->level >= top)
+        return;
+    if (is_ready(scheduler, entity))
+    {
+        take_ready(scheduler, entity);
+        entity->level = top;
+        sched_make_ready(scheduler, entity);
+    }
+    else
+    {
+        entity->level = top;
+    }
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Multilevel feedback queue. Level 0 runs first, round robin inside a level. A process
+// that uses up its quantum moves down a level, and every boost interval all the ready
+// processes go back to the top level their nice value allows, so CPU-bound ones can't starve.
+// A woken process goes SCHED_WAKE_BOOST levels above its top level, ahead of boosted
+// CPU-bound ones. One tick is one timer interrupt (1 ms)
+#define SCHED_LEVELS 8
+#define SCHED_QUANTA_TICKS { 2, 2, 2, 4, 8, 16, 32, 64 }
+#define SCHED_BOOST_INTERVAL_TICKS 500
+#define SCHED_WAKE_BOOST 1
+
+#define NICE_MIN -20
+#define NICE_MAX 19
+// The top level of a process is picked from the first levels by its nice value,
+// nice 0 starts at level 2
+#define SCHED_NICE_LEVELS 4
+
+struct process_queue_t;
+
+typedef struct sched_entity_t {
+    struct sched_entity_t* next;
+    struct sched_entity_t* prev;
+    struct process_queue_t* queue;  // the one it's on, NULL if none
+    void* owner;
+    int nice;
+    uint32_t level;
+    uint32_t ticks_left;            // of its quantum
+} sched_entity_t;
+
+// FIFO of processes: a level of the ready queue, or the processes waiting for one event.
+// A process is on at most one queue, and never while it's running
+typedef struct process_queue_t {
+    sched_entity_t* head;
+    sched_entity_t* tail;
+} process_queue_t;
+
+typedef struct {
+    process_queue_t levels[SCHED_LEVELS];
+    uint32_t quanta[SCHED_LEVELS];
+    uint32_t level_count;
+    uint32_t ready_count;
+    uint32_t boost_interval;        // 0 never boosts
+    uint32_t ticks_to_boost;
+} scheduler_t;
+
+// `quanta` has a quantum for every level. One level with a 1 tick quantum is plain round robin
+void sched_init(scheduler_t* scheduler, const uint32_t* quanta, uint32_t level_count, uint32_t boost_interval);
+// The default levels and quanta above
+void sched_init_default(scheduler_t* scheduler);
+void sched_entity_init(sched_entity_t* entity, void* owner, int nice);
+
+void sched_queue_push(process_queue_t* queue, sched_entity_t* entity);
+// Takes the entity off whatever queue it's on
+void sched_queue_remove(sched_entity_t* entity);
+sched_entity_t* sched_queue_pop(process_queue_t* queue);
+
+// Takes a process off the ready queue or the wait list it's on
+void sched_remove(scheduler_t* scheduler, sched_entity_t* entity);
+// Queued on its current level, for a process that was preempted
+void sched_make_ready(scheduler_t* scheduler, sched_entity_t* entity);
+// Queued above its top level, for a process that was blocked or is new
+void sched_wake(scheduler_t* scheduler, sched_entity_t* entity);
+// Takes the first process of the highest non empty level and gives it a fresh quantum, NULL if none is ready
+sched_entity_t* sched_pick(scheduler_t* scheduler);
+// Accounts a timer tick to `running` (NULL while idle). True if it should be switched out:
+// its quantum is used up (it's moved down a level), or a process on a higher level is ready
+bool sched_tick(scheduler_t* scheduler, sched_entity_t* running);
+// Clamps it to NICE_MIN..NICE_MAX. A ready process above its new top level is moved down to it
+void sched_set_nice(scheduler_t* scheduler, sched_entity_t* entity, int nice);
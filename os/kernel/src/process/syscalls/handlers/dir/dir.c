@@ -1,6 +1,7 @@
 #include "dir.h"
 #include <fcntl.h>
 #include "memory/heap/heap.h"
+#include "memory/scratch/scratch.h"
 #include "process/manager/process_manager.h"
 #include "filesystem/fat/fat.h"
 #include "process/syscalls/handlers/file/file.h"
@@ -197,6 +198,7 @@ int _getdents(unsigned int fd, struct linux_dirent *dirp, unsigned int count)
 
     if (current_process->fd_table[fd].offset >= current_process->fd_table[fd].global_fd->file.file_entry.file_size)
         return 0;
+
     
     // get dir entries
     while (count > 0)
@@ -212,7 +214,8 @@ int _getdents(unsigned int fd, struct linux_dirent *dirp, unsigned int count)
         if (entry_size > count)
             break;
 
-        struct linux_dirent* tmp = kmalloc(entry_size);
+        // d_type is written one byte past the record
+        struct linux_dirent* tmp = scratch_alloc(entry_size + 1);
         if (!tmp) return -ENOMEM;
 
         tmp->d_ino = entry.start_cluster;
@@ -222,7 +225,7 @@ int _getdents(unsigned int fd, struct linux_dirent *dirp, unsigned int count)
         tmp->d_name[name_len] = 0;
         tmp->d_name[name_len + 1] = (entry.attr & FAT_ATTR_DIRECTORY) ? DT_DIR : DT_REG;
         memcpy((void*)((int)dirp + buff_index), tmp, entry_size);
-        kfree(tmp);
+        scratch_free(tmp);
 
         current_process->fd_table[fd].offset++;
         buff_index += entry_size;
@@ -0,0 +1,113 @@
+#include "mem.h"
+#include "process/manager/process_manager.h"
+#include "process/loader/elf_loader.h"
+#include "memory/vma/vma.h"
+
+int32_t _mmap(uint32_t addr, uint32_t len, uint32_t prot, uint32_t flags, int fd, uint32_t page_offset)
+{
+    process_t* current_process = get_current_process();
+    if (current_process == NULL)
+        return -ESRCH;
+
+    uint32_t page_amount = (len + PAGE_SIZE - 1) / PAGE_SIZE;
+    if (len == 0 || page_amount > USER_SPACE_END / PAGE_SIZE || addr % PAGE_SIZE != 0)
+        return -EINVAL;
+    if ((flags & (MAP_SHARED | MAP_PRIVATE)) == 0 || (flags & (MAP_SHARED | MAP_PRIVATE)) == (MAP_SHARED | MAP_PRIVATE))
+        return -EINVAL;
+    if ((flags & MAP_SHARED) && (prot & PROT_WRITE))
+        return -EINVAL; // writes would have to go back to the file
+
+    vma_file_t* file = NULL;
+    if (!(flags & MAP_ANONYMOUS))
+    {
+        if (fd < 0 || fd >= MAX_LOCAL_FD || !current_process->fd_table[fd].is_used)
+            return -EBADF;
+        global_file_descriptor* global_fd = current_process->fd_table[fd].global_fd;
+        if (global_fd == NULL || global_fd->is_device || global_fd->is_dir)
+            return -ENODEV;
+
+        file = vma_file_open(&global_fd->file.file_entry);
+        if (file == NULL)
+            return -ENOMEM;
+    }
+
+    uint32_t first_page = addr / PAGE_SIZE;
+    if (flags & MAP_FIXED)
+    {
+        if (first_page == 0 || first_page + page_amount > USER_SPACE_END / PAGE_SIZE ||
+            !vma_remove_range(&current_process->vmas, first_page, page_amount))
+        {
+            first_page = 0;
+        }
+    }
+    else
+    {
+        // The hint is only taken when it's free
+        if (first_page == 0 || vma_find_free(current_process->vmas, page_amount, first_page,
+            USER_MMAP_END / PAGE_SIZE) != first_page)
+        {
+            first_page = vma_find_free(current_process->vmas, page_amount, USER_MMAP_BASE / PAGE_SIZE,
+                USER_MMAP_END / PAGE_SIZE);
+        }
+    }
+
+    uint32_t vma_flags = (prot & PROT_WRITE ? VMA_WRITE : 0) | (prot & PROT_EXEC ? VMA_EXEC : 0);
+    vma_t* vma = first_page == 0 ? NULL :
+        vma_add(&current_process->vmas, first_page, page_amount, vma_flags, NULL);
+    if (vma == NULL)
+    {
+        if (file != NULL)
+            vma_file_put(file);
+        return -ENOMEM;
+    }
+
+    vma->file = file;
+    vma->file_offset = page_offset * PAGE_SIZE;
+    return first_page * PAGE_SIZE;
+}
+
+int _munmap(uint32_t addr, uint32_t len)
+{
+    process_t* current_process = get_current_process();
+    if (current_process == NULL)
+        return -ESRCH;
+
+    uint32_t page_amount = (len + PAGE_SIZE - 1) / PAGE_SIZE;
+    if (len == 0 || addr % PAGE_SIZE != 0 || addr / PAGE_SIZE + page_amount > USER_SPACE_END / PAGE_SIZE)
+        return -EINVAL;
+
+    if (!vma_remove_range(&current_process->vmas, addr / PAGE_SIZE, page_amount))
+        return -ENOMEM;
+    return 0;
+}
+
+int _getrlimit(uint32_t resource, struct rlimit* limit)
+{
+    process_t* current_process = get_current_process();
+    if (current_process == NULL)
+        return -ESRCH;
+    if (resource != RLIMIT_STACK)
+        return -EINVAL;
+
+    limit->rlim_cur = current_process->stack_limit * PAGE_SIZE;
+    limit->rlim_max = USER_STACK_MAX_PAGES * PAGE_SIZE;
+    return 0;
+}
+
+int _setrlimit(uint32_t resource, const struct rlimit* limit)
+{
+    process_t* current_process = get_current_process();
+    if (current_process == NULL)
+        return -ESRCH;
+    if (resource != RLIMIT_STACK || limit->rlim_cur > limit->rlim_max)
+        return -EINVAL;
+
+    uint32_t max = USER_STACK_MAX_PAGES * PAGE_SIZE;
+    uint32_t current = limit->rlim_cur == RLIM_INFINITY ? max : limit->rlim_cur;
+    if (current > max || (limit->rlim_max != RLIM_INFINITY && limit->rlim_max > max))
+        return -EPERM;
+
+    // At least the page the stack starts with
+    current_process->stack_limit = current / PAGE_SIZE > 0 ? current / PAGE_SIZE : 1;
+    return 0;
+}
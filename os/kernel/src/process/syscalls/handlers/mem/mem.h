@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdint.h>
+#include <errno-base.h>
+
+#define PROT_NONE       0x0
+#define PROT_READ       0x1
+#define PROT_WRITE      0x2
+#define PROT_EXEC       0x4
+
+#define MAP_SHARED      0x01
+#define MAP_PRIVATE     0x02
+#define MAP_FIXED       0x10
+#define MAP_ANONYMOUS   0x20
+
+#define RLIMIT_STACK    3
+#define RLIM_INFINITY   0xFFFFFFFF
+
+struct rlimit {
+    uint32_t rlim_cur;
+    uint32_t rlim_max;
+};
+
+// The arguments of the old mmap syscall (90), passed by pointer
+struct mmap_arg_struct {
+    uint32_t addr;
+    uint32_t len;
+    uint32_t prot;
+    uint32_t flags;
+    uint32_t fd;
+    uint32_t offset;
+};
+
+// Returns the address of the mapping or a negative errno. `page_offset` is in pages, like mmap2.
+// Shared mappings are only allowed read only, where they can't be told apart from private ones
+int32_t _mmap(uint32_t addr, uint32_t len, uint32_t prot, uint32_t flags, int fd, uint32_t page_offset);
+int _munmap(uint32_t addr, uint32_t len);
+
+// Only RLIMIT_STACK, in bytes. The hard limit is the region reserved for the stack.
+// Lowering it doesn't shrink a stack that already grew past it
+int _getrlimit(uint32_t resource, struct rlimit* limit);
+int _setrlimit(uint32_t resource, const struct rlimit* limit);
@@ -6,7 +6,37 @@ void _exit(int status)
     exit_current_process();
 }
 
+int _fork(const struct int_registers* regs)
+{
+    return fork_current_process(regs);
+}
+
 int _getpid()
 {
     return get_current_process()->pid;
-}
\ No newline at end of file
+}
+
+int _nice(int increment)
+{
+    int nice;
+    if (get_process_nice(0, &nice) != 0)
+        return -ESRCH;
+    return set_process_nice(0, nice + increment);
+}
+
+int _getpriority(int which, int who)
+{
+    int nice;
+    if (which != PRIO_PROCESS || who < 0)
+        return -EINVAL;
+    if (get_process_nice(who, &nice) != 0)
+        return -ESRCH;
+    return 20 - nice;
+}
+
+int _setpriority(int which, int who, int priority)
+{
+    if (which != PRIO_PROCESS || who < 0)
+        return -EINVAL;
+    return set_process_nice(who, priority);
+}
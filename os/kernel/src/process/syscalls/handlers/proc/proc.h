@@ -1,4 +1,15 @@
 #pragma once
 
+#include "cpu/idt/isr.h"
+#include <errno-base.h>
+
+#define PRIO_PROCESS 0
+
 void _exit(int status);
-int _getpid();
\ No newline at end of file
+int _fork(const struct int_registers* regs);
+int _getpid();
+// Nice values of the current process or another one (`who` 0 is the current one).
+// getpriority returns 20 - nice like the Linux syscall, so it's never negative
+int _nice(int increment);
+int _getpriority(int which, int who);
+int _setpriority(int which, int who, int priority);
\ No newline at end of file
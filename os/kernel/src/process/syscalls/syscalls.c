@@ -3,6 +3,7 @@
 #include "drivers/vga/vga.h"
 #include "cpu/gdt/gdt.h"
 #include "process/manager/process_manager.h"
+#include "memory/scratch/scratch.h"
 
 static void (*syscall_handler_array[SYSCALLS_MANAGER_MAX_HANDLERS])(struct int_registers *registers);
 
@@ -15,6 +16,7 @@ void syscall_init()
     register_isr_handler(0x80, handle_syscall);
 
     syscalls_manager_attach_handler(1, sys_exit);
+    syscalls_manager_attach_handler(2, sys_fork);
     syscalls_manager_attach_handler(3, sys_read);
     syscalls_manager_attach_handler(4, sys_write);
     syscalls_manager_attach_handler(5, sys_open);
@@ -22,17 +24,29 @@ void syscall_init()
     syscalls_manager_attach_handler(10, sys_unlink);
     syscalls_manager_attach_handler(12, sys_chdir);
     syscalls_manager_attach_handler(19, sys_lseek);
+    syscalls_manager_attach_handler(34, sys_nice);
     syscalls_manager_attach_handler(38, sys_rename);
     syscalls_manager_attach_handler(39, sys_mkdir);
     syscalls_manager_attach_handler(40, sys_rmdir);
     syscalls_manager_attach_handler(40, sys_times);
+    syscalls_manager_attach_handler(75, sys_setrlimit);
+    syscalls_manager_attach_handler(76, sys_getrlimit);
     syscalls_manager_attach_handler(78, sys_gettimeofday);
+    syscalls_manager_attach_handler(90, sys_old_mmap);
+    syscalls_manager_attach_handler(91, sys_munmap);
     syscalls_manager_attach_handler(92, sys_truncate);
     syscalls_manager_attach_handler(93, sys_ftruncate);
+    syscalls_manager_attach_handler(96, sys_getpriority);
+    syscalls_manager_attach_handler(97, sys_setpriority);
     syscalls_manager_attach_handler(106, sys_stat);
     syscalls_manager_attach_handler(108, sys_fstat);
     syscalls_manager_attach_handler(141, sys_getdents);
     syscalls_manager_attach_handler(183, sys_getcwd);
+    syscalls_manager_attach_handler(191, sys_getrlimit);
+    syscalls_manager_attach_handler(192, sys_mmap2);
+#ifdef KERNEL_HEAP_PROFILER
+    syscalls_manager_attach_handler(223, sys_heap_profile);
+#endif
 
 }
 
@@ -43,6 +57,7 @@ static void handle_syscall(struct int_registers* registers)
     {
         get_current_process()->is_kernel_mode = true;
         (*syscall_handler_array[registers->eax])(registers);
+        scratch_reset();
         get_current_process()->is_kernel_mode = false;
         tss_fill_esp0((uint32_t)get_current_process()->kernel_stack);
     }
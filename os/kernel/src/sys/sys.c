@@ -3,12 +3,21 @@
 #include "process/syscalls/handlers/dir/dir.h"
 #include "process/syscalls/handlers/proc/proc.h"
 #include "process/syscalls/handlers/time/time.h"
+#include "process/syscalls/handlers/mem/mem.h"
+#include "memory/paging/paging.h"
+#include "memory/heap/heap_profiler.h"
 
 void sys_exit(struct int_registers *state)
 {
     _exit(state->ebx);
 }
 
+void sys_fork(struct int_registers *state)
+{
+    // The child's pid in the parent, 0 in the child
+    state->eax = _fork(state);
+}
+
 void sys_read(struct int_registers *state)
 {
     // First argument (fd) in ebx, second (buffer) in ecx, third (count) in edx
@@ -56,6 +65,24 @@ void sys_getpid(struct int_registers *state)
     state->eax = _getpid();
 }
 
+void sys_nice(struct int_registers *state)
+{
+    // First argument (increment) in ebx
+    state->eax = _nice(state->ebx);
+}
+
+void sys_getpriority(struct int_registers *state)
+{
+    // First argument (which) in ebx, second (who) in ecx
+    state->eax = _getpriority(state->ebx, state->ecx);
+}
+
+void sys_setpriority(struct int_registers *state)
+{
+    // First argument (which) in ebx, second (who) in ecx, third (nice value) in edx
+    state->eax = _setpriority(state->ebx, state->ecx, state->edx);
+}
+
 void sys_rename(struct int_registers *state)
 {
     // First argument (old path) in ebx, second (new path) in ecx
@@ -84,6 +111,36 @@ void sys_gettimeofday(struct int_registers *state)
     state->eax = _gettimeofday((struct timeval *)state->ebx, (struct timezone *)state->ecx);
 }
 
+void sys_old_mmap(struct int_registers *state)
+{
+    // First argument (struct mmap_arg_struct*) in ebx, the offset is in bytes there
+    struct mmap_arg_struct* args = (struct mmap_arg_struct*)state->ebx;
+    if (args->offset % PAGE_SIZE != 0)
+    {
+        state->eax = -EINVAL;
+        return;
+    }
+    state->eax = _mmap(args->addr, args->len, args->prot, args->flags, args->fd, args->offset / PAGE_SIZE);
+}
+
+void sys_munmap(struct int_registers *state)
+{
+    // First argument (address) in ebx, second (length) in ecx
+    state->eax = _munmap(state->ebx, state->ecx);
+}
+
+void sys_setrlimit(struct int_registers *state)
+{
+    // First argument (resource) in ebx, second (struct rlimit*) in ecx
+    state->eax = _setrlimit(state->ebx, (const struct rlimit*)state->ecx);
+}
+
+void sys_getrlimit(struct int_registers *state)
+{
+    // First argument (resource) in ebx, second (struct rlimit*) in ecx
+    state->eax = _getrlimit(state->ebx, (struct rlimit*)state->ecx);
+}
+
 void sys_truncate(struct int_registers *state)
 {
     // First argument (filename) in ebx, second (length) in ecx
@@ -118,4 +175,18 @@ void sys_getcwd(struct int_registers *state)
 {
     // First argument (buffer) in ebx, second (buffer size) in ecx
     state->eax = _getcwd((char*)state->ebx, state->ecx);
-}
\ No newline at end of file
+}
+
+void sys_mmap2(struct int_registers *state)
+{
+    // Arguments (address, length, prot, flags, fd, offset in pages) in ebx, ecx, edx, esi, edi, ebp
+    state->eax = _mmap(state->ebx, state->ecx, state->edx, state->esi, state->edi, state->ebp);
+}
+
+#ifdef KERNEL_HEAP_PROFILER
+void sys_heap_profile(struct int_registers *state)
+{
+    // First argument (site buffer, or NULL to print them) in ebx, second (site count) in ecx
+    state->eax = _heap_profile((heap_profile_site_t*)state->ebx, state->ecx);
+}
+#endif
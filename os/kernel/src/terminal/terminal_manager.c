@@ -42,6 +42,7 @@ uint32_t create_terminal(uint32_t parent_process_id)
     terminals[i].terminal_fds.stdout = allocate_device_fd();
     terminals[i].terminal_fds.stderr = allocate_device_fd();
     terminals[i].input_len = 0;
+    terminals[i].readers = (process_queue_t){0};
 
     terminals[i].terminal_fds.stdin->_read = read_terminal_input;
 
@@ -78,8 +79,7 @@ int read_terminal_input(void *buf, uint32_t count, uint32_t off, struct global_f
     // yeald blocked until \n pressed
     while (!get_active_terminal_struct()->is_input_ready)
     {
-        get_current_process()->state = PROCESS_BLOCKED;
-        force_switch_process();
+        block_current_process(&get_active_terminal_struct()->readers);
     }
     int copy_len = count;
     get_active_terminal_struct()->is_input_ready = false;
@@ -17,6 +17,7 @@ typedef struct terminal_struct_t {
     bool is_input_ready;
     uint32_t parent_process_pid;
     struct terminal_file_descriptors_t terminal_fds;
+    process_queue_t readers;    // blocked until a line is entered
 } terminal_struct_t;
 
 bool attach_process_to_terminal(uint32_t terminal_id, process_t *proc_info);